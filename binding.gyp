@@ -13,6 +13,10 @@
 				'src/resize.cc',
 				'src/writebuffer.cc',
 				'src/colorconvert.cc',
+				'src/parallel.cc',
+				'src/convolve.cc',
+				'src/quantize.cc',
+				'src/streamdecoder.cc',
 			],
 			'cflags': [
 				'-w',
@@ -40,6 +44,7 @@
 					],
 					'libraries': [
 						'<!@(pkg-config libpng --libs-only-l)',
+						'<!@(pkg-config zlib --libs-only-l)',
 					],
 					'xcode_settings': {
 						'OTHER_CFLAGS': [ '<!@(pkg-config libpng --cflags)' ],
@@ -1,6 +1,8 @@
 "use strict";
 
+var Readable = require('stream').Readable;
 var image = require('./lib/image');
+var decoder = require('./lib/decoder');
 var picha = require('./build/Release/picha.node');
 
 var Image = exports.Image = image.Image;
@@ -20,6 +22,8 @@ var resizeSync = exports.resizeSync = function(img, opt) {
 	return new Image(picha.resizeSync(img, opt));
 };
 
+var resizeCacheStats = exports.resizeCacheStats = picha.resizeCacheStats;
+
 //--
 
 var colorConvert = exports.colorConvert = function(src, opt, cb) {
@@ -71,6 +75,36 @@ function toSupportedSync(image, encodes) {
 	return colorConvertSync(image, { pixel: chooseSupported(image.pixel, encodes) });
 }
 
+// A readable stream of the encoded image, which gets each chunk as the encoder writes it.
+// While the stream's buffer is full the encoder waits at its next block, until read()
+// asks for more or the stream is destroyed.
+function encodeStream(encode, img, encodes, opt) {
+	var resume = null, done = false;
+	var stream = new Readable({
+		read: function() {
+			if (resume) resume();
+		},
+		destroy: function(err, cb) {
+			done = true;
+			if (resume) resume();
+			cb(err);
+		}
+	});
+	toSupported(img, encodes, function(err, img) {
+		if (done) return;
+		if (err) return stream.destroy(err);
+		resume = encode(img, opt || {}, function(err) {
+			resume = null;
+			if (done) return;
+			if (err) return stream.destroy(err);
+			stream.push(null);
+		}, function(err, chunk) {
+			return done || stream.push(chunk);
+		});
+	});
+	return stream;
+}
+
 //--
 
 if (catalog['image/png']) {
@@ -93,13 +127,17 @@ if (catalog['image/png']) {
 		if (typeof opt === 'function') { cb = opt; opt = {}; }
 		toSupported(img, pngEncodes, function(err, img) {
 			if (err) return cb(err);
-			picha.encodePng(img, opt, cb);
+			picha.encodePng(img, opt || {}, cb);
 		});
 	};
 
 	var encodePngSync = exports.encodePngSync = function(img, opt) {
 		return picha.encodePngSync(toSupportedSync(img, pngEncodes), opt || {});
 	};
+
+	var encodePngStream = exports.encodePngStream = function(img, opt) {
+		return encodeStream(picha.encodePng, img, pngEncodes, opt);
+	};
 }
 
 //--
@@ -131,6 +169,29 @@ if (catalog['image/jpeg']) {
 	var encodeJpegSync = exports.encodeJpegSync = function(img, opt) {
 		return picha.encodeJpegSync(toSupportedSync(img, jpegEncodes), opt || {});
 	};
+
+	var encodeJpegStream = exports.encodeJpegStream = function(img, opt) {
+		return encodeStream(picha.encodeJpeg, img, jpegEncodes, opt);
+	};
+
+	var transformJpeg = exports.transformJpeg = function(buf, opt, cb) {
+		if (typeof opt === 'function') { cb = opt; opt = {}; }
+		picha.transformJpeg(buf, opt, cb);
+	};
+
+	var transformJpegSync = exports.transformJpegSync = function(buf, opt) {
+		return picha.transformJpegSync(buf, opt || {});
+	};
+
+	var requantizeJpeg = exports.requantizeJpeg = function(buf, opt, cb) {
+		if (typeof opt === 'function') { cb = opt; opt = {}; }
+		picha.transformJpeg(buf, { quality: opt.quality === undefined ? 85 : opt.quality, optimize: opt.optimize }, cb);
+	};
+
+	var requantizeJpegSync = exports.requantizeJpegSync = function(buf, opt) {
+		opt = opt || {};
+		return picha.transformJpegSync(buf, { quality: opt.quality === undefined ? 85 : opt.quality, optimize: opt.optimize });
+	};
 }
 
 //--
@@ -231,3 +292,7 @@ var decodeSync = exports.decodeSync = function(buf, opt) {
 	}
 	throw new Error("unsupported image file");
 };
+
+var createDecoder = exports.createDecoder = function(mimetype, opt) {
+	return new decoder.Decoder(picha.createDecoder(mimetype, opt || {}));
+};
@@ -0,0 +1,73 @@
+"use strict";
+
+var Image = require('./image').Image;
+
+// Feeds the chunks of an encoded image to a native streaming decoder. Chunks pushed while
+// an earlier push is still decoding are joined and decoded together on the next one.
+var Decoder = exports.Decoder = function(native) {
+	this.native = native;
+	this.pending = [];
+	this.busy = false;
+	this.error = null;
+	this.ended = false;
+	this.endcb = null;
+};
+
+Decoder.prototype.push = function(chunk) {
+	if (this.ended) throw new Error("decoder ended");
+	if (!this.error && chunk.length > 0) this.pending.push(chunk);
+	this.pump();
+};
+
+Decoder.prototype.end = function(cb) {
+	if (this.ended) throw new Error("decoder ended");
+	this.ended = true;
+	this.endcb = cb;
+	this.pump();
+};
+
+Decoder.prototype.pushSync = function(chunk) {
+	if (this.busy || this.pending.length > 0) throw new Error("decoder busy");
+	this.native.pushSync(chunk);
+};
+
+Decoder.prototype.endSync = function() {
+	if (this.busy || this.pending.length > 0) throw new Error("decoder busy");
+	this.ended = true;
+	return new Image(this.native.endSync());
+};
+
+// The width, height and pixel of the image, and the rows decoded, as of the last chunk
+// to finish decoding, once the header has been decoded.
+Decoder.prototype.stat = function() {
+	return this.native.stat();
+};
+
+Decoder.prototype.pump = function() {
+	var self = this;
+	if (self.busy) return;
+
+	if (self.pending.length > 0) {
+		var chunk = self.pending.length === 1 ? self.pending[0] : Buffer.concat(self.pending);
+		self.pending = [];
+		self.busy = true;
+		self.native.push(chunk, function(err) {
+			self.busy = false;
+			if (err) {
+				self.error = err;
+				self.pending = [];
+			}
+			self.pump();
+		});
+	}
+	else if (self.endcb) {
+		var cb = self.endcb;
+		self.endcb = null;
+		if (self.error) return cb(self.error);
+		self.busy = true;
+		self.native.end(function(err, img) {
+			self.busy = false;
+			cb(err, img && new Image(img));
+		});
+	}
+};
@@ -0,0 +1,581 @@
+#include <string.h>
+#include <algorithm>
+
+#include "convolve.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#	define PICHA_SSE2
+#	include <emmintrin.h>
+#endif
+
+#if defined(PICHA_SSE2) && defined(__GNUC__)
+#	define PICHA_AVX2
+#	include <immintrin.h>
+#	define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+namespace picha {
+
+	// Every kernel accumulates each output sample in the same order as the scalar code,
+	// and none of them use fused multiply-add, so all paths produce identical results.
+
+	namespace {
+
+		const float unpack8 = 1 / 255.0f;
+		const float unpack16 = 1 / 65535.0f;
+
+		template <typename T> void unpackRowScalar(const T * src, float * dst, int count, float scale) {
+			for (int n = 0; n < count; ++n)
+				dst[n] = src[n] * scale;
+		}
+
+		template <typename T> void packRowScalar(const float * src, T * dst, int count, float range) {
+			for (int n = 0; n < count; ++n)
+				dst[n] = T(std::max(0.0f, std::min(range, src[n] * range + 0.5f)));
+		}
+
+		template <int N> void convolveRowScalar(const PaddedContribs<float> & contribs, const float * src, float * dst, int x, int width) {
+			const int taps = contribs.taps;
+			const float * w = &contribs.weights[x * taps];
+			for (dst += x * N; x < width; ++x, w += taps, dst += N) {
+				const float * s = src + contribs.left[x] * N;
+				float acc[N] = {};
+				for (int k = 0; k < taps; ++k, s += N)
+					for (int p = 0; p < N; ++p)
+						acc[p] += w[k] * s[p];
+				for (int p = 0; p < N; ++p)
+					dst[p] = acc[p];
+			}
+		}
+
+		void convolveColumnsScalar(const float * const * rows, const float * weights, int taps, float * dst, int n, int count) {
+			for (; n < count; ++n) {
+				float acc = 0;
+				for (int k = 0; k < taps; ++k)
+					acc += weights[k] * rows[k][n];
+				dst[n] = acc;
+			}
+		}
+
+		const int FixedRowShift = FixedWeightBits - FixedRowBits;
+		const int FixedColumnShift = FixedWeightBits + FixedRowBits;
+
+		inline int16_t fixedRowSample(int32_t acc) {
+			acc = (acc + (1 << (FixedRowShift - 1))) >> FixedRowShift;
+			return int16_t(std::max(-32768, std::min(32767, acc)));
+		}
+
+		inline uint8_t fixedColumnSample(int32_t acc) {
+			acc = (acc + (1 << (FixedColumnShift - 1))) >> FixedColumnShift;
+			return uint8_t(std::max(0, std::min(255, acc)));
+		}
+
+		template <int N> void convolveRowFixedScalar(const PaddedContribs<int16_t> & contribs, const uint8_t * src, int16_t * dst, int x, int width) {
+			const int taps = contribs.taps;
+			const int16_t * w = &contribs.weights[x * taps];
+			for (dst += x * N; x < width; ++x, w += taps, dst += N) {
+				const uint8_t * s = src + contribs.left[x] * N;
+				int32_t acc[N] = {};
+				for (int k = 0; k < taps; ++k, s += N)
+					for (int p = 0; p < N; ++p)
+						acc[p] += w[k] * s[p];
+				for (int p = 0; p < N; ++p)
+					dst[p] = fixedRowSample(acc[p]);
+			}
+		}
+
+		void convolveColumnsFixedScalar(const int16_t * const * rows, const int16_t * weights, int taps, uint8_t * dst, int n, int count) {
+			for (; n < count; ++n) {
+				int32_t acc = 0;
+				for (int k = 0; k < taps; ++k)
+					acc += weights[k] * rows[k][n];
+				dst[n] = fixedColumnSample(acc);
+			}
+		}
+
+#ifdef PICHA_SSE2
+
+		void unpackRow8SSE(const uint8_t * src, float * dst, int count) {
+			const __m128i zero = _mm_setzero_si128();
+			const __m128 scale = _mm_set1_ps(unpack8);
+			int n = 0;
+			for (; n + 16 <= count; n += 16) {
+				__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + n));
+				__m128i lo = _mm_unpacklo_epi8(b, zero), hi = _mm_unpackhi_epi8(b, zero);
+				_mm_storeu_ps(dst + n, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), scale));
+				_mm_storeu_ps(dst + n + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), scale));
+				_mm_storeu_ps(dst + n + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), scale));
+				_mm_storeu_ps(dst + n + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), scale));
+			}
+			unpackRowScalar(src + n, dst + n, count - n, unpack8);
+		}
+
+		void unpackRow16SSE(const uint16_t * src, float * dst, int count) {
+			const __m128i zero = _mm_setzero_si128();
+			const __m128 scale = _mm_set1_ps(unpack16);
+			int n = 0;
+			for (; n + 8 <= count; n += 8) {
+				__m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + n));
+				_mm_storeu_ps(dst + n, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(w, zero)), scale));
+				_mm_storeu_ps(dst + n + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(w, zero)), scale));
+			}
+			unpackRowScalar(src + n, dst + n, count - n, unpack16);
+		}
+
+		inline __m128i packLaneSSE(const float * src, __m128 range) {
+			__m128 v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src), range), _mm_set1_ps(0.5f));
+			return _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(v, range), _mm_setzero_ps()));
+		}
+
+		void packRow8SSE(const float * src, uint8_t * dst, int count) {
+			const __m128 range = _mm_set1_ps(255.0f);
+			int n = 0;
+			for (; n + 16 <= count; n += 16) {
+				__m128i a = _mm_packs_epi32(packLaneSSE(src + n, range), packLaneSSE(src + n + 4, range));
+				__m128i b = _mm_packs_epi32(packLaneSSE(src + n + 8, range), packLaneSSE(src + n + 12, range));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + n), _mm_packus_epi16(a, b));
+			}
+			packRowScalar(src + n, dst + n, count - n, 255.0f);
+		}
+
+		void packRow16SSE(const float * src, uint16_t * dst, int count) {
+			// There is no unsigned 32 to 16 bit pack before SSE4.1, so bias into signed range and back.
+			const __m128 range = _mm_set1_ps(65535.0f);
+			const __m128i bias = _mm_set1_epi32(32768);
+			const __m128i unbias = _mm_set1_epi16(-32768);
+			int n = 0;
+			for (; n + 8 <= count; n += 8) {
+				__m128i a = _mm_sub_epi32(packLaneSSE(src + n, range), bias);
+				__m128i b = _mm_sub_epi32(packLaneSSE(src + n + 4, range), bias);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + n), _mm_xor_si128(_mm_packs_epi32(a, b), unbias));
+			}
+			packRowScalar(src + n, dst + n, count - n, 65535.0f);
+		}
+
+		void convolveRow1SSE(const PaddedContribs<float> & contribs, const float * src, float * dst, int width) {
+			const int taps = contribs.taps;
+			int x = 0;
+			for (; x + 4 <= width; x += 4) {
+				const float * w = &contribs.weights[x * taps];
+				const float * s0 = src + contribs.left[x];
+				const float * s1 = src + contribs.left[x + 1];
+				const float * s2 = src + contribs.left[x + 2];
+				const float * s3 = src + contribs.left[x + 3];
+				__m128 acc = _mm_setzero_ps();
+				for (int k = 0; k < taps; ++k) {
+					__m128 wv = _mm_setr_ps(w[k], w[taps + k], w[2 * taps + k], w[3 * taps + k]);
+					acc = _mm_add_ps(acc, _mm_mul_ps(wv, _mm_setr_ps(s0[k], s1[k], s2[k], s3[k])));
+				}
+				_mm_storeu_ps(dst + x, acc);
+			}
+			convolveRowScalar<1>(contribs, src, dst, x, width);
+		}
+
+		void convolveRow2SSE(const PaddedContribs<float> & contribs, const float * src, float * dst, int width) {
+			const int taps = contribs.taps;
+			int x = 0;
+			for (; x + 2 <= width; x += 2) {
+				const float * w = &contribs.weights[x * taps];
+				const float * s0 = src + contribs.left[x] * 2;
+				const float * s1 = src + contribs.left[x + 1] * 2;
+				__m128 acc = _mm_setzero_ps();
+				for (int k = 0; k < taps; ++k) {
+					__m128 sv = _mm_loadl_pi(_mm_setzero_ps(), reinterpret_cast<const __m64*>(s0 + 2 * k));
+					sv = _mm_loadh_pi(sv, reinterpret_cast<const __m64*>(s1 + 2 * k));
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_setr_ps(w[k], w[k], w[taps + k], w[taps + k]), sv));
+				}
+				_mm_storeu_ps(dst + x * 2, acc);
+			}
+			convolveRowScalar<2>(contribs, src, dst, x, width);
+		}
+
+		// Three channel pixels are loaded and stored four floats at a time; the extra lane
+		// reads into the source row slack and is overwritten by the next pixel or lands in
+		// the destination row slack.
+		template <int N> void convolveRowWideSSE(const PaddedContribs<float> & contribs, const float * src, float * dst, int width) {
+			const int taps = contribs.taps;
+			const float * w = &contribs.weights[0];
+			for (int x = 0; x < width; ++x, w += taps, dst += N) {
+				const float * s = src + contribs.left[x] * N;
+				__m128 acc = _mm_setzero_ps();
+				for (int k = 0; k < taps; ++k, s += N)
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(s)));
+				_mm_storeu_ps(dst, acc);
+			}
+		}
+
+		void convolveColumnsSSE(const float * const * rows, const float * weights, int taps, float * dst, int count) {
+			int n = 0;
+			for (; n + 8 <= count; n += 8) {
+				__m128 a = _mm_setzero_ps(), b = _mm_setzero_ps();
+				for (int k = 0; k < taps; ++k) {
+					__m128 wv = _mm_set1_ps(weights[k]);
+					a = _mm_add_ps(a, _mm_mul_ps(wv, _mm_loadu_ps(rows[k] + n)));
+					b = _mm_add_ps(b, _mm_mul_ps(wv, _mm_loadu_ps(rows[k] + n + 4)));
+				}
+				_mm_storeu_ps(dst + n, a);
+				_mm_storeu_ps(dst + n + 4, b);
+			}
+			convolveColumnsScalar(rows, weights, taps, dst, n, count);
+		}
+
+		inline __m128i weightPair(int16_t w0, int16_t w1) {
+			return _mm_set1_epi32(int32_t(uint16_t(w0)) | (int32_t(w1) << 16));
+		}
+
+		inline __m128i loadBytes32(const uint8_t * s) {
+			int32_t p;
+			memcpy(&p, s, 4);
+			return _mm_cvtsi32_si128(p);
+		}
+
+		inline int32_t loadPair16(const int16_t * w) {
+			int32_t p;
+			memcpy(&p, w, 4);
+			return p;
+		}
+
+		// Each madd accumulates a pair of taps, so the samples of two neighbouring source
+		// pixels are interleaved channel by channel.
+		template <int N> void convolveRowFixedWideSSE(const PaddedContribs<int16_t> & contribs, const uint8_t * src, int16_t * dst, int width) {
+			const int taps = contribs.taps;
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i round = _mm_set1_epi32(1 << (FixedRowShift - 1));
+			const int16_t * w = &contribs.weights[0];
+			for (int x = 0; x < width; ++x, w += taps, dst += N) {
+				const uint8_t * s = src + contribs.left[x] * N;
+				__m128i acc = _mm_setzero_si128();
+				int k = 0;
+				for (; k + 2 <= taps; k += 2) {
+					__m128i a = _mm_unpacklo_epi8(loadBytes32(s + N * k), zero);
+					__m128i b = _mm_unpacklo_epi8(loadBytes32(s + N * k + N), zero);
+					acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weightPair(w[k], w[k + 1])));
+				}
+				if (k < taps) {
+					__m128i a = _mm_unpacklo_epi8(loadBytes32(s + N * k), zero);
+					acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), weightPair(w[k], 0)));
+				}
+				acc = _mm_srai_epi32(_mm_add_epi32(acc, round), FixedRowShift);
+				acc = _mm_packs_epi32(acc, acc);
+				if (N > 2)
+					_mm_storel_epi64(reinterpret_cast<__m128i*>(dst), acc);
+				else {
+					int32_t p = _mm_cvtsi128_si32(acc);
+					memcpy(dst, &p, 4);
+				}
+			}
+		}
+
+		// Single channel rows are filtered four destination pixels at a time, one per lane.
+		void convolveRowFixed1SSE(const PaddedContribs<int16_t> & contribs, const uint8_t * src, int16_t * dst, int width) {
+			const int taps = contribs.taps;
+			const __m128i round = _mm_set1_epi32(1 << (FixedRowShift - 1));
+			int x = 0;
+			for (; x + 4 <= width; x += 4) {
+				const int16_t * w = &contribs.weights[x * taps];
+				const uint8_t * s0 = src + contribs.left[x];
+				const uint8_t * s1 = src + contribs.left[x + 1];
+				const uint8_t * s2 = src + contribs.left[x + 2];
+				const uint8_t * s3 = src + contribs.left[x + 3];
+				__m128i acc = _mm_setzero_si128();
+				int k = 0;
+				for (; k + 2 <= taps; k += 2) {
+					__m128i v = _mm_setr_epi32(s0[k] | (s0[k + 1] << 16), s1[k] | (s1[k + 1] << 16),
+						s2[k] | (s2[k + 1] << 16), s3[k] | (s3[k + 1] << 16));
+					__m128i wv = _mm_setr_epi32(loadPair16(w + k), loadPair16(w + taps + k),
+						loadPair16(w + 2 * taps + k), loadPair16(w + 3 * taps + k));
+					acc = _mm_add_epi32(acc, _mm_madd_epi16(v, wv));
+				}
+				if (k < taps) {
+					__m128i v = _mm_setr_epi32(s0[k], s1[k], s2[k], s3[k]);
+					__m128i wv = _mm_setr_epi32(uint16_t(w[k]), uint16_t(w[taps + k]), uint16_t(w[2 * taps + k]), uint16_t(w[3 * taps + k]));
+					acc = _mm_add_epi32(acc, _mm_madd_epi16(v, wv));
+				}
+				acc = _mm_srai_epi32(_mm_add_epi32(acc, round), FixedRowShift);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x), _mm_packs_epi32(acc, acc));
+			}
+			convolveRowFixedScalar<1>(contribs, src, dst, x, width);
+		}
+
+		void convolveColumnsFixedSSE(const int16_t * const * rows, const int16_t * weights, int taps, uint8_t * dst, int count) {
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i round = _mm_set1_epi32(1 << (FixedColumnShift - 1));
+			int n = 0;
+			for (; n + 8 <= count; n += 8) {
+				__m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+				int k = 0;
+				for (; k + 2 <= taps; k += 2) {
+					__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k] + n));
+					__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k + 1] + n));
+					__m128i wp = weightPair(weights[k], weights[k + 1]);
+					lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wp));
+					hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wp));
+				}
+				if (k < taps) {
+					__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k] + n));
+					__m128i wp = weightPair(weights[k], 0);
+					lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), wp));
+					hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, zero), wp));
+				}
+				lo = _mm_srai_epi32(_mm_add_epi32(lo, round), FixedColumnShift);
+				hi = _mm_srai_epi32(_mm_add_epi32(hi, round), FixedColumnShift);
+				__m128i p = _mm_packs_epi32(lo, hi);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + n), _mm_packus_epi16(p, p));
+			}
+			convolveColumnsFixedScalar(rows, weights, taps, dst, n, count);
+		}
+
+#endif
+
+#ifdef PICHA_AVX2
+
+		bool haveAvx2() {
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2");
+		}
+
+		AVX2_TARGET void unpackRow8AVX2(const uint8_t * src, float * dst, int count) {
+			const __m256 scale = _mm256_set1_ps(unpack8);
+			int n = 0;
+			for (; n + 16 <= count; n += 16) {
+				__m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + n)));
+				__m256i b = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + n + 8)));
+				_mm256_storeu_ps(dst + n, _mm256_mul_ps(_mm256_cvtepi32_ps(a), scale));
+				_mm256_storeu_ps(dst + n + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(b), scale));
+			}
+			unpackRowScalar(src + n, dst + n, count - n, unpack8);
+		}
+
+		AVX2_TARGET inline __m256i packLaneAVX2(const float * src, __m256 range) {
+			__m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(src), range), _mm256_set1_ps(0.5f));
+			return _mm256_cvttps_epi32(_mm256_max_ps(_mm256_min_ps(v, range), _mm256_setzero_ps()));
+		}
+
+		AVX2_TARGET void packRow8AVX2(const float * src, uint8_t * dst, int count) {
+			const __m256 range = _mm256_set1_ps(255.0f);
+			const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+			int n = 0;
+			for (; n + 32 <= count; n += 32) {
+				__m256i a = _mm256_packs_epi32(packLaneAVX2(src + n, range), packLaneAVX2(src + n + 8, range));
+				__m256i b = _mm256_packs_epi32(packLaneAVX2(src + n + 16, range), packLaneAVX2(src + n + 24, range));
+				__m256i p = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(a, b), order);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + n), p);
+			}
+			packRow8SSE(src + n, dst + n, count - n);
+		}
+
+		template <int N> AVX2_TARGET void convolveRowWideAVX2(const PaddedContribs<float> & contribs, const float * src, float * dst, int width) {
+			const int taps = contribs.taps;
+			int x = 0;
+			for (; x + 2 <= width; x += 2) {
+				const float * w = &contribs.weights[x * taps];
+				const float * s0 = src + contribs.left[x] * N;
+				const float * s1 = src + contribs.left[x + 1] * N;
+				__m256 acc = _mm256_setzero_ps();
+				for (int k = 0; k < taps; ++k) {
+					__m256 sv = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(s0 + N * k)), _mm_loadu_ps(s1 + N * k), 1);
+					__m256 wv = _mm256_insertf128_ps(_mm256_set1_ps(w[k]), _mm_set1_ps(w[taps + k]), 1);
+					acc = _mm256_add_ps(acc, _mm256_mul_ps(wv, sv));
+				}
+				_mm_storeu_ps(dst + x * N, _mm256_castps256_ps128(acc));
+				_mm_storeu_ps(dst + x * N + N, _mm256_extractf128_ps(acc, 1));
+			}
+			convolveRowScalar<N>(contribs, src, dst, x, width);
+		}
+
+		AVX2_TARGET void convolveColumnsAVX2(const float * const * rows, const float * weights, int taps, float * dst, int count) {
+			int n = 0;
+			for (; n + 16 <= count; n += 16) {
+				__m256 a = _mm256_setzero_ps(), b = _mm256_setzero_ps();
+				for (int k = 0; k < taps; ++k) {
+					__m256 wv = _mm256_set1_ps(weights[k]);
+					a = _mm256_add_ps(a, _mm256_mul_ps(wv, _mm256_loadu_ps(rows[k] + n)));
+					b = _mm256_add_ps(b, _mm256_mul_ps(wv, _mm256_loadu_ps(rows[k] + n + 8)));
+				}
+				_mm256_storeu_ps(dst + n, a);
+				_mm256_storeu_ps(dst + n + 8, b);
+			}
+			convolveColumnsScalar(rows, weights, taps, dst, n, count);
+		}
+
+		AVX2_TARGET inline __m256i weightPairAVX2(int16_t w0, int16_t w1) {
+			return _mm256_set1_epi32(int32_t(uint16_t(w0)) | (int32_t(w1) << 16));
+		}
+
+		// Byte shuffle that spreads four source pixels over the two 128 bit lanes as 16 bit
+		// samples, the low lane interleaving taps 0 and 1 and the high lane taps 2 and 3, so
+		// each madd pair is one channel of two neighbouring taps.
+		template <int N> AVX2_TARGET inline __m256i fixedTapShuffle() {
+			int8_t m[32];
+			for (int lane = 0; lane < 2; ++lane) {
+				for (int j = 0; j < 8; ++j) {
+					int c = j / 2, t = 2 * lane + j % 2;
+					m[lane * 16 + j * 2] = int8_t(c < N ? t * N + c : -1);
+					m[lane * 16 + j * 2 + 1] = -1;
+				}
+			}
+			return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(m));
+		}
+
+		// One destination pixel per iteration, four taps per step. Needs the taps padded to
+		// a multiple of FixedTapMultiple.
+		template <int N> AVX2_TARGET void convolveRowFixedWideAVX2(const PaddedContribs<int16_t> & contribs, const uint8_t * src, int16_t * dst, int width) {
+			const int taps = contribs.taps;
+			const __m256i shuffle = fixedTapShuffle<N>();
+			const __m256i spread = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+			const __m128i round = _mm_set1_epi32(1 << (FixedRowShift - 1));
+			for (int x = 0; x < width; ++x) {
+				const int16_t * w = &contribs.weights[x * taps];
+				const uint8_t * s = src + contribs.left[x] * N;
+				__m256i acc = _mm256_setzero_si256();
+				for (int k = 0; k < taps; k += 4) {
+					__m256i v = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + N * k)));
+					__m256i wv = _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(w + k))), spread);
+					acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_shuffle_epi8(v, shuffle), wv));
+				}
+				__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+				sum = _mm_srai_epi32(_mm_add_epi32(sum, round), FixedRowShift);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x * N), _mm_packs_epi32(sum, sum));
+			}
+		}
+
+		AVX2_TARGET void convolveColumnsFixedAVX2(const int16_t * const * rows, const int16_t * weights, int taps, uint8_t * dst, int count) {
+			const __m256i round = _mm256_set1_epi32(1 << (FixedColumnShift - 1));
+			int n = 0;
+			for (; n + 16 <= count; n += 16) {
+				__m256i lo = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
+				int k = 0;
+				for (; k + 2 <= taps; k += 2) {
+					__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k] + n));
+					__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k + 1] + n));
+					__m256i wp = weightPairAVX2(weights[k], weights[k + 1]);
+					lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), wp));
+					hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), wp));
+				}
+				if (k < taps) {
+					__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k] + n));
+					__m256i wp = weightPairAVX2(weights[k], 0);
+					lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, _mm256_setzero_si256()), wp));
+					hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, _mm256_setzero_si256()), wp));
+				}
+				// The unpacks and packs both work within 128 bit lanes, so the samples come back
+				// in order within each lane, and one permute joins the lanes.
+				lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), FixedColumnShift);
+				hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), FixedColumnShift);
+				__m256i p = _mm256_packs_epi32(lo, hi);
+				p = _mm256_permute4x64_epi64(_mm256_packus_epi16(p, p), _MM_SHUFFLE(3, 1, 2, 0));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + n), _mm256_castsi256_si128(p));
+			}
+			convolveColumnsFixedScalar(rows, weights, taps, dst, n, count);
+		}
+
+		const bool avx2 = haveAvx2();
+
+#endif
+
+	}
+
+	void unpackRow8(const uint8_t * src, float * dst, int count) {
+#ifdef PICHA_AVX2
+		if (avx2) return unpackRow8AVX2(src, dst, count);
+#endif
+#ifdef PICHA_SSE2
+		unpackRow8SSE(src, dst, count);
+#else
+		unpackRowScalar(src, dst, count, unpack8);
+#endif
+	}
+
+	void unpackRow16(const uint16_t * src, float * dst, int count) {
+#ifdef PICHA_SSE2
+		unpackRow16SSE(src, dst, count);
+#else
+		unpackRowScalar(src, dst, count, unpack16);
+#endif
+	}
+
+	void packRow8(const float * src, uint8_t * dst, int count) {
+#ifdef PICHA_AVX2
+		if (avx2) return packRow8AVX2(src, dst, count);
+#endif
+#ifdef PICHA_SSE2
+		packRow8SSE(src, dst, count);
+#else
+		packRowScalar(src, dst, count, 255.0f);
+#endif
+	}
+
+	void packRow16(const float * src, uint16_t * dst, int count) {
+#ifdef PICHA_SSE2
+		packRow16SSE(src, dst, count);
+#else
+		packRowScalar(src, dst, count, 65535.0f);
+#endif
+	}
+
+	void convolveRow(const PaddedContribs<float> & contribs, const float * src, float * dst, int width, int channels) {
+#ifdef PICHA_AVX2
+		if (avx2 && channels == 3) return convolveRowWideAVX2<3>(contribs, src, dst, width);
+		if (avx2 && channels == 4) return convolveRowWideAVX2<4>(contribs, src, dst, width);
+#endif
+#ifdef PICHA_SSE2
+		switch (channels) {
+			case 1: convolveRow1SSE(contribs, src, dst, width); break;
+			case 2: convolveRow2SSE(contribs, src, dst, width); break;
+			case 3: convolveRowWideSSE<3>(contribs, src, dst, width); break;
+			case 4: convolveRowWideSSE<4>(contribs, src, dst, width); break;
+		}
+#else
+		switch (channels) {
+			case 1: convolveRowScalar<1>(contribs, src, dst, 0, width); break;
+			case 2: convolveRowScalar<2>(contribs, src, dst, 0, width); break;
+			case 3: convolveRowScalar<3>(contribs, src, dst, 0, width); break;
+			case 4: convolveRowScalar<4>(contribs, src, dst, 0, width); break;
+		}
+#endif
+	}
+
+	void convolveColumns(const float * const * rows, const float * weights, int taps, float * dst, int count) {
+#ifdef PICHA_AVX2
+		if (avx2) return convolveColumnsAVX2(rows, weights, taps, dst, count);
+#endif
+#ifdef PICHA_SSE2
+		convolveColumnsSSE(rows, weights, taps, dst, count);
+#else
+		convolveColumnsScalar(rows, weights, taps, dst, 0, count);
+#endif
+	}
+
+	void convolveRowFixed(const PaddedContribs<int16_t> & contribs, const uint8_t * src, int16_t * dst, int width, int channels) {
+#ifdef PICHA_AVX2
+		if (avx2 && channels == 2) return convolveRowFixedWideAVX2<2>(contribs, src, dst, width);
+		if (avx2 && channels == 3) return convolveRowFixedWideAVX2<3>(contribs, src, dst, width);
+		if (avx2 && channels == 4) return convolveRowFixedWideAVX2<4>(contribs, src, dst, width);
+#endif
+		switch (channels) {
+#ifdef PICHA_SSE2
+			case 1: convolveRowFixed1SSE(contribs, src, dst, width); break;
+			case 2: convolveRowFixedWideSSE<2>(contribs, src, dst, width); break;
+			case 3: convolveRowFixedWideSSE<3>(contribs, src, dst, width); break;
+			case 4: convolveRowFixedWideSSE<4>(contribs, src, dst, width); break;
+#else
+			case 1: convolveRowFixedScalar<1>(contribs, src, dst, 0, width); break;
+			case 2: convolveRowFixedScalar<2>(contribs, src, dst, 0, width); break;
+			case 3: convolveRowFixedScalar<3>(contribs, src, dst, 0, width); break;
+			case 4: convolveRowFixedScalar<4>(contribs, src, dst, 0, width); break;
+#endif
+		}
+	}
+
+	void convolveColumnsFixed(const int16_t * const * rows, const int16_t * weights, int taps, uint8_t * dst, int count) {
+#ifdef PICHA_AVX2
+		if (avx2) return convolveColumnsFixedAVX2(rows, weights, taps, dst, count);
+#endif
+#ifdef PICHA_SSE2
+		convolveColumnsFixedSSE(rows, weights, taps, dst, count);
+#else
+		convolveColumnsFixedScalar(rows, weights, taps, dst, 0, count);
+#endif
+	}
+
+}
@@ -0,0 +1,52 @@
+#ifndef picha_convolve_h_
+#define picha_convolve_h_
+
+#include <stdint.h>
+#include <vector>
+
+namespace picha {
+
+	//----------------------------------------------------------------------------------------------------------------
+	//--
+
+	// Horizontal filter weights padded to the same number of taps for every destination
+	// pixel. The padding weights are zero and 'left' is shifted so a window never runs
+	// off the end of the source row.
+	template <typename W> struct PaddedContribs {
+		int taps;
+		std::vector<int> left;
+		std::vector<W> weights;
+	};
+
+	// Floats of padding a row buffer needs past its last pixel for the row kernels.
+	static const int RowSlack = 8;
+
+	// Rows of samples to and from floats in [0, 1], matching PixelTraits unpack/pack.
+	void unpackRow8(const uint8_t * src, float * dst, int count);
+	void unpackRow16(const uint16_t * src, float * dst, int count);
+	void packRow8(const float * src, uint8_t * dst, int count);
+	void packRow16(const float * src, uint16_t * dst, int count);
+
+	// dst pixel x = sum over k of weights[x * taps + k] * src pixel (left[x] + k).
+	void convolveRow(const PaddedContribs<float> & contribs, const float * src, float * dst, int width, int channels);
+
+	// dst[n] = sum over k of weights[k] * rows[k][n].
+	void convolveColumns(const float * const * rows, const float * weights, int taps, float * dst, int count);
+
+	// The fixed point kernels work on 8 bit samples. Weights carry FixedWeightBits of
+	// fraction and the intermediate rows of horizontally filtered samples carry FixedRowBits.
+	static const int FixedWeightBits = 14;
+	static const int FixedRowBits = 6;
+
+	// The row weights must be padded to a multiple of FixedTapMultiple taps. The source
+	// row must be readable for FixedRowSlack bytes past its last pixel, and the destination
+	// row writable for FixedTapMultiple samples past its end.
+	static const int FixedTapMultiple = 4;
+	static const int FixedRowSlack = 16;
+
+	void convolveRowFixed(const PaddedContribs<int16_t> & contribs, const uint8_t * src, int16_t * dst, int width, int channels);
+	void convolveColumnsFixed(const int16_t * const * rows, const int16_t * weights, int taps, uint8_t * dst, int count);
+
+}
+
+#endif // picha_convolve_h_
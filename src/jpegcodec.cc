@@ -3,14 +3,25 @@
 #include <setjmp.h>
 #include <stdlib.h>
 #include <string.h>
+#include <cmath>
+#include <algorithm>
+#include <vector>
 #include <node.h>
 #include <node_buffer.h>
 
 #include "jpegcodec.h"
+#include "writebuffer.h"
+#include "parallel.h"
+#include "streamdecoder.h"
 
 #include <jpeglib.h>
 #include <jerror.h>
 
+// Rgba decodes and region decodes use libjpeg-turbo's extensions to the libjpeg API.
+#ifndef JCS_EXTENSIONS
+#error "picha needs libjpeg-turbo 1.5 or later"
+#endif
+
 namespace picha {
 
 	namespace {
@@ -33,12 +44,328 @@ namespace picha {
 		}
 	}
 
-	void cmyk_to_rgb(unsigned char *cmyk, unsigned char *rgb, int width) {
-		for (int i = 0; i < width; ++i, cmyk += 4, rgb += 3) {
-			rgb[0] = int(cmyk[0]) * cmyk[3] / 255;
-			rgb[1] = int(cmyk[1]) * cmyk[3] / 255;
-			rgb[2] = int(cmyk[2]) * cmyk[3] / 255;
+	// Convert a row of (Adobe inverted) CMYK to an 8 bit pixel layout. Four channel
+	// output may convert the row in place.
+	void cmykToPixel(const uint8_t *cmyk, uint8_t *dst, int width, PixelMode pixel) {
+		const int channels = pixelChannels(pixel);
+		for (int i = 0; i < width; ++i, cmyk += 4, dst += channels) {
+			int k = cmyk[3];
+			int r = int(cmyk[0]) * k / 255;
+			int g = int(cmyk[1]) * k / 255;
+			int b = int(cmyk[2]) * k / 255;
+			if (channels >= 3) {
+				dst[0] = r;
+				dst[1] = g;
+				dst[2] = b;
+			}
+			else {
+				dst[0] = (r * 19595 + g * 38470 + b * 7471 + 32768) >> 16;
+			}
+			if (channels == 2 || channels == 4)
+				dst[channels - 1] = 255;
+		}
+	}
+
+	void greyToGreya(const uint8_t *grey, uint8_t *dst, int width) {
+		for (int i = 0; i < width; ++i, dst += 2) {
+			dst[0] = grey[i];
+			dst[1] = 255;
+		}
+	}
+
+	// How much accuracy to trade for speed. 'fast' uses the integer fast DCT, and 'draft'
+	// also drops fancy upsampling and block smoothing when decoding.
+	enum JpegSpeed { JPEG_ACCURATE, JPEG_FAST, JPEG_DRAFT };
+
+	bool getJpegSpeed(JpegSpeed & speed, Local<Object> opts) {
+		Local<Value> v = Nan::Get(opts, Nan::New(speed_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (v->IsUndefined())
+			return true;
+		if (v->StrictEquals(Nan::New(accurate_symbol)))
+			speed = JPEG_ACCURATE;
+		else if (v->StrictEquals(Nan::New(fast_symbol)))
+			speed = JPEG_FAST;
+		else if (v->StrictEquals(Nan::New(draft_symbol)))
+			speed = JPEG_DRAFT;
+		else {
+			Nan::ThrowError("invalid speed");
+			return false;
+		}
+		return true;
+	}
+
+	bool getJpegThreads(int & threads, Local<Object> opts) {
+		Local<Value> v = Nan::Get(opts, Nan::New(threads_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (v->IsUndefined())
+			return true;
+		double n = v->NumberValue(Nan::GetCurrentContext()).FromMaybe(0);
+		if (n != n || n < 1) {
+			Nan::ThrowError("invalid thread count");
+			return false;
+		}
+		threads = int(std::min(n, 256.0));
+		return true;
+	}
+
+	//------------------------------------------------------------------------------------------------------------
+	//--
+
+	// Restart markers split a scan's entropy coded data into segments that code on their
+	// own, which lets bands of a sequential jpeg decode and encode in parallel.
+	struct JpegSegment {
+		JpegSegment(size_t s, size_t e) : start(s), end(e) {}
+		size_t start, end;
+	};
+
+	// Bands are never smaller than this.
+	static const int JpegMinBandPixels = 64 * 1024;
+
+	// Find the frame header (SOF) and the start of the entropy coded data following the
+	// first scan header (SOS) by walking the markers from the start of the file.
+	bool jpegHeaderOffsets(const JOCTET * data, size_t len, size_t & sof, size_t & entropy) {
+		if (len < 4 || data[0] != 0xFF || data[1] != 0xD8)
+			return false;
+		sof = 0;
+		for (size_t p = 2; p + 4 <= len; ) {
+			if (data[p] != 0xFF)
+				return false;
+			int m = data[p + 1];
+			if (m == 0xFF) {
+				++p;
+				continue;
+			}
+			if (m >= 0xC0 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC)
+				sof = p;
+			p += 2 + ((size_t(data[p + 2]) << 8) | data[p + 3]);
+			if (m == 0xDA) {
+				entropy = p;
+				return sof != 0 && p <= len;
+			}
+		}
+		return false;
+	}
+
+	// Split the entropy coded data at its restart markers, up to the marker that ends the scan.
+	bool jpegSegments(const JOCTET * data, size_t len, size_t entropy, std::vector<JpegSegment> & segments) {
+		size_t start = entropy;
+		for (size_t p = entropy; p + 1 < len; ) {
+			if (data[p] != 0xFF) {
+				++p;
+				continue;
+			}
+			size_t q = p + 1;
+			while (q < len && data[q] == 0xFF)
+				++q;
+			if (q == len)
+				break;
+			if (data[q] == 0) {
+				p = q + 1;
+				continue;
+			}
+			segments.push_back(JpegSegment(start, p));
+			if (data[q] < 0xD0 || data[q] > 0xD7)
+				return true;
+			start = p = q + 1;
+		}
+		return false;
+	}
+
+	void jpegSetHeight(JOCTET * data, size_t sof, int height) {
+		data[sof + 5] = JOCTET(height >> 8);
+		data[sof + 6] = JOCTET(height);
+	}
+
+	// Append the index-th entropy coded segment of a scan, after the restart marker that
+	// precedes it. Markers number from RST0 after the first segment.
+	void jpegAppendSegment(std::vector<JOCTET> & out, const JOCTET * data, size_t len, int index) {
+		if (index > 0) {
+			out.push_back(0xFF);
+			out.push_back(JOCTET(0xD0 + (index - 1) % 8));
+		}
+		out.insert(out.end(), data, data + len);
+	}
+
+	void jpegAppendEnd(std::vector<JOCTET> & out) {
+		out.push_back(0xFF);
+		out.push_back(0xD9);
+	}
+
+	//------------------------------------------------------------------------------------------------------------
+	//--
+
+	// Cameras embed a small jpeg thumbnail in the EXIF data of an APP1 segment. It's
+	// referenced from the second image file directory (IFD1) of the TIFF structure there.
+	struct ExifReader {
+		ExifReader(const JOCTET * d, size_t l) : data(d), len(l), motorola(l > 0 && d[0] == 'M') {}
+		const JOCTET * data;
+		size_t len;
+		bool motorola;
+
+		uint32_t get(size_t p, int bytes) const {
+			uint32_t v = 0;
+			for (int i = 0; i < bytes; ++i)
+				v |= uint32_t(data[p + i]) << (8 * (motorola ? bytes - 1 - i : i));
+			return v;
+		}
+
+		// The offset and length of the thumbnail, relative to the TIFF header.
+		bool thumbnail(size_t & offset, size_t & length) const {
+			if (len < 8 || data[0] != data[1] || (data[0] != 'I' && data[0] != 'M') || get(2, 2) != 42)
+				return false;
+
+			// Skip over IFD0 to IFD1.
+			size_t ifd = get(4, 4);
+			if (ifd + 2 > len || ifd + 2 + get(ifd, 2) * 12 + 4 > len)
+				return false;
+			ifd = get(ifd + 2 + get(ifd, 2) * 12, 4);
+			if (ifd == 0 || ifd + 2 > len || ifd + 2 + get(ifd, 2) * 12 > len)
+				return false;
+
+			offset = length = 0;
+			for (size_t e = ifd + 2, n = get(ifd, 2); n > 0; --n, e += 12) {
+				uint32_t tag = get(e, 2);
+				uint32_t value = get(e + 2, 2) == 3 ? get(e + 8, 2) : get(e + 8, 4);
+				if (tag == 0x0201)
+					offset = value;
+				else if (tag == 0x0202)
+					length = value;
+			}
+			return offset > 0 && length >= 4 && offset < len && length <= len - offset &&
+				data[offset] == 0xFF && data[offset + 1] == 0xD8;
+		}
+	};
+
+	// Find the EXIF thumbnail in the markers ahead of the first scan.
+	bool jpegExifThumbnail(const JOCTET * data, size_t len, size_t & offset, size_t & length) {
+		if (len < 4 || data[0] != 0xFF || data[1] != 0xD8)
+			return false;
+		for (size_t p = 2; p + 4 <= len; ) {
+			if (data[p] != 0xFF)
+				return false;
+			int m = data[p + 1];
+			if (m == 0xFF) {
+				++p;
+				continue;
+			}
+			if (m == 0xDA)
+				return false;
+			size_t seglen = (size_t(data[p + 2]) << 8) | data[p + 3];
+			if (p + 2 + seglen > len)
+				return false;
+			if (m == 0xE1 && seglen >= 16 && memcmp(data + p + 4, "Exif\0\0", 6) == 0) {
+				ExifReader exif(data + p + 10, seglen - 8);
+				if (exif.thumbnail(offset, length)) {
+					offset += p + 10;
+					return true;
+				}
+			}
+			p += 2 + seglen;
+		}
+		return false;
+	}
+
+	// Decode options. Scaling picks the smallest of libjpeg's n/8 DCT scales that is no
+	// smaller than the requested size, so a following resize never has to upscale.
+	struct JpegDecodeOptions {
+		JpegDecodeOptions() : pixel(INVALID_PIXEL), maxwidth(0), maxheight(0), scale(1), crop(false), speed(JPEG_ACCURATE), threads(1), thumbnail(0), maxscans(0) {}
+		PixelMode pixel;
+		int maxwidth, maxheight;
+		double scale;
+
+		// A region of the scaled image to decode.
+		bool crop;
+		int cropx, cropy, cropwidth, cropheight;
+
+		JpegSpeed speed;
+
+		// Cap on the threads that decode the bands of a jpeg with restart markers.
+		int threads;
+
+		// Decode the EXIF thumbnail instead when its longer side is at least this size.
+		int thumbnail;
+
+		// Stop a multi-scan (progressive) jpeg after this many scans, or zero for all.
+		int maxscans;
+	};
+
+	static const int JpegScaleDenom = 8;
+
+	int jpegScaleNum(const JpegDecodeOptions & opts, int width, int height) {
+		double f = opts.scale;
+		if (opts.maxwidth > 0)
+			f = std::min(f, opts.maxwidth / double(width));
+		if (opts.maxheight > 0)
+			f = std::min(f, opts.maxheight / double(height));
+		int num = int(std::ceil(f * JpegScaleDenom - 1e-9));
+		return std::max(1, std::min(JpegScaleDenom, num));
+	}
+
+	bool getJpegDecodeOptions(JpegDecodeOptions & o, Local<Object> opts) {
+		Local<Value> v = Nan::Get(opts, Nan::New(pixel_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			o.pixel = pixelSymbolToEnum(v);
+			if (o.pixel == INVALID_PIXEL) {
+				Nan::ThrowError("invalid pixel mode");
+				return false;
+			}
+		}
+		v = Nan::Get(opts, Nan::New(maxWidth_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			o.maxwidth = v->Int32Value(Nan::GetCurrentContext()).FromMaybe(0);
+			if (o.maxwidth <= 0) {
+				Nan::ThrowError("invalid maxWidth");
+				return false;
+			}
+		}
+		v = Nan::Get(opts, Nan::New(maxHeight_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			o.maxheight = v->Int32Value(Nan::GetCurrentContext()).FromMaybe(0);
+			if (o.maxheight <= 0) {
+				Nan::ThrowError("invalid maxHeight");
+				return false;
+			}
+		}
+		v = Nan::Get(opts, Nan::New(scale_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			o.scale = v->NumberValue(Nan::GetCurrentContext()).FromMaybe(0);
+			if (o.scale != o.scale || o.scale <= 0) {
+				Nan::ThrowError("invalid scale");
+				return false;
+			}
+		}
+		v = Nan::Get(opts, Nan::New(region_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			MaybeLocal<Object> mregion = v->ToObject(Nan::GetCurrentContext());
+			if (mregion.IsEmpty())
+				return false;
+			Local<Object> region = mregion.ToLocalChecked();
+			o.crop = true;
+			o.cropx = Nan::Get(region, Nan::New(x_symbol)).FromMaybe(Local<Value>(Nan::Undefined()))->Int32Value(Nan::GetCurrentContext()).FromMaybe(-1);
+			o.cropy = Nan::Get(region, Nan::New(y_symbol)).FromMaybe(Local<Value>(Nan::Undefined()))->Int32Value(Nan::GetCurrentContext()).FromMaybe(-1);
+			o.cropwidth = Nan::Get(region, Nan::New(width_symbol)).FromMaybe(Local<Value>(Nan::Undefined()))->Int32Value(Nan::GetCurrentContext()).FromMaybe(0);
+			o.cropheight = Nan::Get(region, Nan::New(height_symbol)).FromMaybe(Local<Value>(Nan::Undefined()))->Int32Value(Nan::GetCurrentContext()).FromMaybe(0);
+			if (o.cropx < 0 || o.cropy < 0 || o.cropwidth <= 0 || o.cropheight <= 0) {
+				Nan::ThrowError("invalid region");
+				return false;
+			}
+		}
+		v = Nan::Get(opts, Nan::New(preferEmbeddedThumbnail_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			o.thumbnail = v->Int32Value(Nan::GetCurrentContext()).FromMaybe(0);
+			if (o.thumbnail <= 0) {
+				Nan::ThrowError("invalid preferEmbeddedThumbnail");
+				return false;
+			}
+		}
+		v = Nan::Get(opts, Nan::New(maxScans_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			o.maxscans = v->Int32Value(Nan::GetCurrentContext()).FromMaybe(0);
+			if (o.maxscans <= 0) {
+				Nan::ThrowError("invalid maxScans");
+				return false;
+			}
 		}
+		return getJpegSpeed(o.speed, opts) && getJpegThreads(o.threads, opts);
 	}
 
 	struct JpegReader {
@@ -48,8 +375,20 @@ namespace picha {
 		jpeg_error_mgr jerr;
 		jpeg_source_mgr jsrc;
 		jpeg_decompress_struct cinfo;
+		const JOCTET * srcdata;
+		size_t srclen;
+		int threads;
+		int maxscans;
+
+		// The region to decode, in the scaled image, and a scanline buffer for rows that
+		// can't be read straight into the destination.
+		bool crop;
+		int cropx, cropy, cropwidth, cropheight;
+		std::vector<JSAMPLE> rowbuf;
 
-		JpegReader() : isopen(false), error(0) {}
+		PixelMode pixel;
+
+		JpegReader() : isopen(false), error(0), srcdata(0), srclen(0), threads(1), maxscans(0), crop(false), pixel(INVALID_PIXEL) {}
 		~JpegReader() { close(); if (error) free(error); }
 
 		void close() {
@@ -57,12 +396,17 @@ namespace picha {
 			isopen = false;
 		}
 
-		void open(char * buf, size_t len) {
+		void create() {
 			cinfo.err = jpeg_std_error(&jerr);
 			cinfo.err->error_exit = &JpegReader::onError;
 			cinfo.client_data = this;
 
 			jpeg_create_decompress(&cinfo);
+			isopen = true;
+		}
+
+		void open(char * buf, size_t len, bool saveprofile = false) {
+			create();
 			assert(cinfo.src == 0);
 			cinfo.src = &jsrc;
 			jsrc.init_source = initSource;
@@ -71,56 +415,222 @@ namespace picha {
 			jsrc.resync_to_restart = jpeg_resync_to_restart;
 			jsrc.term_source = termSource;
 			jsrc.bytes_in_buffer = len;
+			srcdata = (JOCTET*)buf;
+			srclen = len;
 			jsrc.next_input_byte = (JOCTET*)buf;
 
-			isopen = true;
-
 			if (setjmp(jmpbuf))
 				return;
 
+			if (saveprofile)
+				jpeg_save_markers(&cinfo, JPEG_APP0 + 2, 0xFFFF);
 			jpeg_read_header(&cinfo, true);
+			header();
+		}
+
+		// Work out the output once the header has been read.
+		void header() {
+			jpeg_calc_output_dimensions(&cinfo);
+
+			if (cinfo.out_color_space == JCS_RGB || cinfo.out_color_space == JCS_CMYK)
+				pixel = RGB_PIXEL;
+			else if (cinfo.out_color_space == JCS_GRAYSCALE)
+				pixel = GREY_PIXEL;
+		}
+
+		// Where the EXIF thumbnail is, if it has the main image's shape rather than a
+		// letterboxed one, and opens as a jpeg.
+		bool thumbnail(size_t & offset, size_t & length, int & thumbwidth, int & thumbheight) {
+			if (!jpegExifThumbnail(srcdata, srclen, offset, length))
+				return false;
+			JpegReader thumb;
+			thumb.open((char*)srcdata + offset, length);
+			if (thumb.error || thumb.pixel == INVALID_PIXEL)
+				return false;
+			int64_t w = cinfo.image_width, h = cinfo.image_height;
+			thumbwidth = thumb.cinfo.image_width;
+			thumbheight = thumb.cinfo.image_height;
+			return std::abs(thumbwidth * h - thumbheight * w) <= std::max(w, h);
+		}
+
+		// Set up the output for the decode options, after a successful open. A region is
+		// always in the main image, so it never decodes the thumbnail.
+		void configure(const JpegDecodeOptions & opts) {
+			size_t offset, length;
+			int thumbwidth, thumbheight;
+			if (opts.thumbnail > 0 && !opts.crop && thumbnail(offset, length, thumbwidth, thumbheight) &&
+					std::max(thumbwidth, thumbheight) >= opts.thumbnail) {
+				const JOCTET * data = srcdata;
+				close();
+				open((char*)data + offset, length);
+				if (error)
+					return;
+			}
+
+			if (setjmp(jmpbuf))
+				return;
+
+			// libjpeg converts to the requested layout itself, and skips the chroma
+			// entirely for grey output. CMYK is converted as it is read out.
+			if (opts.pixel != INVALID_PIXEL && pixel != INVALID_PIXEL) {
+				switch (opts.pixel) {
+					case R16_PIXEL: pixel = GREY_PIXEL; break;
+					case R16G16_PIXEL: pixel = GREYA_PIXEL; break;
+					case R16G16B16_PIXEL: pixel = RGB_PIXEL; break;
+					case R16G16B16A16_PIXEL: pixel = RGBA_PIXEL; break;
+					default: pixel = opts.pixel; break;
+				}
+				if (cinfo.out_color_space != JCS_CMYK) {
+					if (pixel == RGB_PIXEL)
+						cinfo.out_color_space = JCS_RGB;
+					else if (pixel == RGBA_PIXEL)
+						cinfo.out_color_space = JCS_EXT_RGBA;
+					else
+						cinfo.out_color_space = JCS_GRAYSCALE;
+				}
+			}
+
+			if (opts.speed != JPEG_ACCURATE) {
+				cinfo.dct_method = JDCT_IFAST;
+				cinfo.do_block_smoothing = false;
+			}
+			if (opts.speed == JPEG_DRAFT)
+				cinfo.do_fancy_upsampling = false;
+
+			threads = opts.threads;
+			maxscans = opts.maxscans;
+			cinfo.scale_num = jpegScaleNum(opts, cinfo.image_width, cinfo.image_height);
+			cinfo.scale_denom = JpegScaleDenom;
+			jpeg_calc_output_dimensions(&cinfo);
+
+			if (opts.crop) {
+				if (int64_t(opts.cropx) + opts.cropwidth > cinfo.output_width || int64_t(opts.cropy) + opts.cropheight > cinfo.output_height) {
+					error = strdup("region outside the image");
+					return;
+				}
+				crop = true;
+				cropx = opts.cropx;
+				cropy = opts.cropy;
+				cropwidth = opts.cropwidth;
+				cropheight = opts.cropheight;
+			}
+		}
+
+		// Whether any component is subsampled, so 'draft' skips fancy upsampling.
+		bool subsampled() {
+			for (int c = 1; c < cinfo.num_components; ++c) {
+				if (cinfo.comp_info[c].h_samp_factor != cinfo.max_h_samp_factor || cinfo.comp_info[c].v_samp_factor != cinfo.max_v_samp_factor)
+					return true;
+			}
+			return false;
 		}
 
+		// The output size for a scale of num / JpegScaleDenom, matching libjpeg's rounding.
+		int scaledWidth(int num) { return int((int64_t(cinfo.image_width) * num + JpegScaleDenom - 1) / JpegScaleDenom); }
+		int scaledHeight(int num) { return int((int64_t(cinfo.image_height) * num + JpegScaleDenom - 1) / JpegScaleDenom); }
+
 		void decode(const NativeImage &dst) {
+			if (decodeBands(dst))
+				return;
+
 			if (setjmp(jmpbuf))
 				return;
 
+			// A preview of a multi-scan jpeg reads only its first scans, and outputs the
+			// coefficients they refine to, through libjpeg's buffered image mode.
+			bool preview = maxscans > 0 && jpeg_has_multiple_scans(&cinfo);
+			cinfo.buffered_image = preview;
 			jpeg_start_decompress(&cinfo);
+			if (preview) {
+				int r;
+				do
+					r = jpeg_consume_input(&cinfo);
+				while (r != JPEG_REACHED_EOI && (r != JPEG_SCAN_COMPLETED || cinfo.input_scan_number < maxscans));
+				jpeg_start_output(&cinfo, cinfo.input_scan_number);
+			}
 
-			if (cinfo.out_color_space == JCS_CMYK) {
-				unsigned char *buf = new unsigned char[dst.width * 4];
-				for(int y = 0; y < dst.height; ++y) {
-					JSAMPLE* p = (JSAMPLE*)(&buf[0]);
-					int r = jpeg_read_scanlines(&cinfo, &p, 1);
-					assert(r == 1);
-					cmyk_to_rgb(&buf[0], reinterpret_cast<uint8_t*>(dst.row(y)), dst.width);
-				}
-				delete[] buf;
+			// A region widens to whole iMCU columns, and the rows above it are skipped, so
+			// only the blocks covering the region go through the IDCT.
+			int left = 0;
+			if (crop) {
+				JDIMENSION xoffset = cropx, width = cropwidth;
+				jpeg_crop_scanline(&cinfo, &xoffset, &width);
+				left = cropx - int(xoffset);
+				if (cropy > 0)
+					jpeg_skip_scanlines(&cinfo, cropy);
 			}
-			else {
-				for(int y = 0; y < dst.height; ++y) {
-					JSAMPLE* p = (JSAMPLE*)(dst.row(y));
-					int r = jpeg_read_scanlines(&cinfo, &p, 1);
-					assert(r == 1);
-				}
+
+			readRows(dst, 0, dst.height, left);
+
+			// Rows below a region, and the scans after a preview, are never read.
+			if (preview || cinfo.output_scanline < cinfo.output_height)
+				jpeg_abort_decompress(&cinfo);
+			else
+				jpeg_finish_decompress(&cinfo);
+		}
+
+		// Read rows y to y + count of dst. Rows are read straight into the destination when
+		// they line up with it, and CMYK rows convert in place for four channel output.
+		void readRows(const NativeImage &dst, int y, int count, int left) {
+			for (int end = y + count; y < end; ++y) {
+				bool r = readRow(dst, y, left);
+				assert(r);
 			}
+		}
 
-			jpeg_finish_decompress(&cinfo);
+		// Read row y of dst, or return false when a suspending source has run out of data.
+		bool readRow(const NativeImage &dst, int y, int left) {
+			const int components = cinfo.output_components;
+			const bool cmyk = cinfo.out_color_space == JCS_CMYK;
+			const bool convert = cmyk || dst.pixel == GREYA_PIXEL;
+			bool direct = left == 0 && int(cinfo.output_width) == dst.width && (!convert || (cmyk && dst.pixel == RGBA_PIXEL));
+			if (!direct)
+				rowbuf.resize(cinfo.output_width * components);
+
+			uint8_t * out = reinterpret_cast<uint8_t*>(dst.row(y));
+			JSAMPLE* p = direct ? out : &rowbuf[0];
+			if (jpeg_read_scanlines(&cinfo, &p, 1) != 1)
+				return false;
+			const uint8_t * in = direct ? out : &rowbuf[left * components];
+			if (cmyk)
+				cmykToPixel(in, out, dst.width, dst.pixel);
+			else if (dst.pixel == GREYA_PIXEL)
+				greyToGreya(in, out, dst.width);
+			else if (!direct)
+				memcpy(out, in, dst.width * components);
+			return true;
 		}
 
-		PixelMode getPixel() {
-			if (cinfo.out_color_space == JCS_RGB)
-				return RGB_PIXEL;
-			if (cinfo.out_color_space == JCS_GRAYSCALE)
-				return GREY_PIXEL;
-			if (cinfo.out_color_space == JCS_CMYK)
-				return RGB_PIXEL;
-			return INVALID_PIXEL;
+		// Decode one band of a parallel decode from its own stream, discarding the
+		// leading rows that are only there for upsampling context.
+		void decodeBand(const JpegReader & parent, const NativeImage &dst, int skip, int y, int count) {
+			if (setjmp(jmpbuf))
+				return;
+
+			cinfo.out_color_space = parent.cinfo.out_color_space;
+			cinfo.scale_num = parent.cinfo.scale_num;
+			cinfo.scale_denom = parent.cinfo.scale_denom;
+			cinfo.dct_method = parent.cinfo.dct_method;
+			cinfo.do_fancy_upsampling = parent.cinfo.do_fancy_upsampling;
+			cinfo.do_block_smoothing = parent.cinfo.do_block_smoothing;
+			jpeg_start_decompress(&cinfo);
+
+			rowbuf.resize(cinfo.output_width * cinfo.output_components);
+			for (int i = 0; i < skip; ++i) {
+				JSAMPLE* p = &rowbuf[0];
+				jpeg_read_scanlines(&cinfo, &p, 1);
+			}
+			readRows(dst, y, count, 0);
+			jpeg_abort_decompress(&cinfo);
 		}
 
-		int width() { return cinfo.image_width; }
+		bool decodeBands(const NativeImage &dst);
 
-		int height() { return cinfo.image_height; }
+		PixelMode getPixel() { return pixel; }
+
+		int width() { return crop ? cropwidth : cinfo.output_width; }
+
+		int height() { return crop ? cropheight : cinfo.output_height; }
 
 		static void onError(j_common_ptr cinfo) {
 			char errbuf[JMSG_LENGTH_MAX];
@@ -131,6 +641,102 @@ namespace picha {
 		}
 	};
 
+	struct JpegDecodeBands {
+		const JpegReader & reader;
+		const NativeImage & dst;
+		const std::vector<JpegSegment> & segments;
+		size_t sof, entropy;
+		int mcus, rows, step, groups, bands;
+		bool context;
+		std::vector<char*> errors;
+
+		JpegDecodeBands(const JpegReader & r, const NativeImage & d, const std::vector<JpegSegment> & s)
+			: reader(r), dst(d), segments(s) {}
+
+		void operator()(int band) {
+			const jpeg_decompress_struct & cinfo = reader.cinfo;
+			const int imcuh = cinfo.max_v_samp_factor * DCTSIZE;
+			const int interval = cinfo.restart_interval;
+			const int outrows = cinfo.max_v_samp_factor * int(cinfo.scale_num) * DCTSIZE / int(cinfo.scale_denom);
+
+			// The rows of iMCUs this band outputs, and the rows it decodes.
+			int r0 = std::min(rows, int(int64_t(band) * groups / bands) * step);
+			int r1 = std::min(rows, int(int64_t(band + 1) * groups / bands) * step);
+			int top = context && r0 > 0 ? r0 - step : r0;
+			int bottom = context ? std::min(rows, r1 + 1) : r1;
+			int first = int(int64_t(top) * mcus / interval);
+			int last = int((int64_t(bottom) * mcus - 1) / interval);
+
+			std::vector<JOCTET> stream(reader.srcdata, reader.srcdata + entropy);
+			jpegSetHeight(&stream[0], sof, std::min(int(cinfo.image_height), bottom * imcuh) - top * imcuh);
+			for (int s = first; s <= last; ++s)
+				jpegAppendSegment(stream, reader.srcdata + segments[s].start, segments[s].end - segments[s].start, s - first);
+			jpegAppendEnd(stream);
+
+			int y = r0 * outrows;
+			int count = std::min(dst.height, r1 * outrows) - y;
+			JpegReader b;
+			b.open(reinterpret_cast<char*>(&stream[0]), stream.size());
+			if (!b.error)
+				b.decodeBand(reader, dst, (r0 - top) * outrows, y, count);
+			errors[band] = b.error;
+			b.error = 0;
+		}
+	};
+
+	// Restart markers on iMCU row boundaries let bands of rows decode in parallel, each
+	// from a copy of the headers followed by its own segments. When upsampling reads the
+	// neighbouring rows a band starts a segment early and ends an iMCU row late.
+	bool JpegReader::decodeBands(const NativeImage &dst) {
+		if (threads < 2 || crop || cinfo.progressive_mode || cinfo.restart_interval == 0 || cinfo.comps_in_scan != cinfo.num_components)
+			return false;
+		size_t sof, entropy;
+		if (!jpegHeaderOffsets(srcdata, srclen, sof, entropy))
+			return false;
+
+		const int imcuw = cinfo.max_h_samp_factor * DCTSIZE, imcuh = cinfo.max_v_samp_factor * DCTSIZE;
+		const int interval = cinfo.restart_interval;
+		const int mcus = (cinfo.image_width + imcuw - 1) / imcuw;
+		const int rows = (cinfo.image_height + imcuh - 1) / imcuh;
+		std::vector<JpegSegment> segments;
+		if (!jpegSegments(srcdata, srclen, entropy, segments) || int64_t(segments.size()) != (int64_t(mcus) * rows + interval - 1) / interval)
+			return false;
+
+		// Segments start every 'step' rows of iMCUs.
+		int a = interval, b = mcus;
+		while (b) { int t = a % b; a = b; b = t; }
+		const int step = interval / a;
+		const int groups = (rows + step - 1) / step;
+		bool context = false;
+		for (int c = 0; c < cinfo.num_components; ++c)
+			context = context || (cinfo.do_fancy_upsampling && cinfo.comp_info[c].v_samp_factor != cinfo.max_v_samp_factor);
+
+		// Decoding a segment of context costs a band a group of rows, so bands need a few.
+		int bands = int(std::min(int64_t(std::min(threads, context ? groups / 4 : groups)), int64_t(dst.width) * dst.height / JpegMinBandPixels));
+		if (bands < 2)
+			return false;
+
+		JpegDecodeBands job(*this, dst, segments);
+		job.sof = sof;
+		job.entropy = entropy;
+		job.mcus = mcus;
+		job.rows = rows;
+		job.step = step;
+		job.groups = groups;
+		job.bands = bands;
+		job.context = context;
+		job.errors.resize(bands, 0);
+		parallelFor(bands, bands, job);
+
+		for (int i = 0; i < bands; ++i) {
+			if (!error)
+				error = job.errors[i];
+			else
+				free(job.errors[i]);
+		}
+		return true;
+	}
+
 	struct JpegDecodeCtx {
 		Nan::Persistent<Object> dstimage;
 		Nan::Persistent<Object> buffer;
@@ -157,21 +763,28 @@ namespace picha {
 	}
 
 	NAN_METHOD(decodeJpeg) {
-		if (info.Length() != 3 || !Buffer::HasInstance(info[0]) || !info[2]->IsFunction()) {
+		if (info.Length() != 3 || !Buffer::HasInstance(info[0]) || !info[1]->IsObject() || !info[2]->IsFunction()) {
 			Nan::ThrowError("expected: decodeJpeg(srcbuffer, opts, cb)");
 			return;
 		}
 		MaybeLocal<Object> msrcbuf = info[0]->ToObject(Nan::GetCurrentContext());
-		if (msrcbuf.IsEmpty())
+		MaybeLocal<Object> mopts = info[1]->ToObject(Nan::GetCurrentContext());
+		if (msrcbuf.IsEmpty() || mopts.IsEmpty())
 			return;
 		Local<Object> srcbuf = msrcbuf.ToLocalChecked();
 		Local<Function> cb = Local<Function>::Cast(info[2]);
 
+		JpegDecodeOptions opts;
+		if (!getJpegDecodeOptions(opts, mopts.ToLocalChecked()))
+			return;
+
 		char* srcdata = Buffer::Data(srcbuf);
 		size_t srclen = Buffer::Length(srcbuf);
 
 		JpegDecodeCtx * ctx = new JpegDecodeCtx;
 		ctx->reader.open(srcdata, srclen);
+		if (!ctx->reader.error)
+			ctx->reader.configure(opts);
 		if (ctx->reader.error) {
 			makeCallback(cb, ctx->reader.error, Nan::Undefined());
 			delete ctx;
@@ -197,20 +810,27 @@ namespace picha {
 	}
 
 	NAN_METHOD(decodeJpegSync) {
-		if (info.Length() != 2 || !Buffer::HasInstance(info[0])) {
+		if (info.Length() != 2 || !Buffer::HasInstance(info[0]) || !info[1]->IsObject()) {
 			Nan::ThrowError("expected: decodeJpegSync(srcbuffer, opts)");
 			return;
 		}
 		MaybeLocal<Object> msrcbuf = info[0]->ToObject(Nan::GetCurrentContext());
-		if (msrcbuf.IsEmpty())
+		MaybeLocal<Object> mopts = info[1]->ToObject(Nan::GetCurrentContext());
+		if (msrcbuf.IsEmpty() || mopts.IsEmpty())
 			return;
 		Local<Object> srcbuf = msrcbuf.ToLocalChecked();
 
+		JpegDecodeOptions opts;
+		if (!getJpegDecodeOptions(opts, mopts.ToLocalChecked()))
+			return;
+
 		char* srcdata = Buffer::Data(srcbuf);
 		size_t srclen = Buffer::Length(srcbuf);
 
 		JpegReader reader;
 		reader.open(srcdata, srclen);
+		if (!reader.error)
+			reader.configure(opts);
 		if (reader.error) {
 			Nan::ThrowError(reader.error);
 			return;
@@ -257,90 +877,472 @@ namespace picha {
 		Nan::Set(stat, Nan::New(width_symbol), Nan::New<Integer>(reader.width()));
 		Nan::Set(stat, Nan::New(height_symbol), Nan::New<Integer>(reader.height()));
 		Nan::Set(stat, Nan::New(pixel_symbol), pixelEnumToSymbol(pixel));
+
+		// The sizes each n/8 decode scale produces, smallest first.
+		Local<Array> scales = Nan::New<Array>(JpegScaleDenom);
+		for (int num = 1; num <= JpegScaleDenom; ++num) {
+			Local<Object> scaled = Nan::New<Object>();
+			Nan::Set(scaled, Nan::New(scale_symbol), Nan::New<Number>(num / double(JpegScaleDenom)));
+			Nan::Set(scaled, Nan::New(width_symbol), Nan::New<Integer>(reader.scaledWidth(num)));
+			Nan::Set(scaled, Nan::New(height_symbol), Nan::New<Integer>(reader.scaledHeight(num)));
+			Nan::Set(scales, num - 1, scaled);
+		}
+		Nan::Set(stat, Nan::New(scales_symbol), scales);
+
+		// The speed modes that change how this image decodes. 'draft' only differs from
+		// 'fast' when the chroma is subsampled.
+		Local<Array> speeds = Nan::New<Array>();
+		Nan::Set(speeds, 0, Nan::New(accurate_symbol));
+		Nan::Set(speeds, 1, Nan::New(fast_symbol));
+		if (reader.subsampled())
+			Nan::Set(speeds, 2, Nan::New(draft_symbol));
+		Nan::Set(stat, Nan::New(speeds_symbol), speeds);
+		Nan::Set(stat, Nan::New(progressive_symbol), Nan::New<Boolean>(reader.cinfo.progressive_mode != 0));
+
+		size_t offset, length;
+		int thumbwidth, thumbheight;
+		if (reader.thumbnail(offset, length, thumbwidth, thumbheight)) {
+			Local<Object> thumb = Nan::New<Object>();
+			Nan::Set(thumb, Nan::New(width_symbol), Nan::New<Integer>(thumbwidth));
+			Nan::Set(thumb, Nan::New(height_symbol), Nan::New<Integer>(thumbheight));
+			Nan::Set(thumb, Nan::New(size_symbol), Nan::New<Number>(double(length)));
+			Nan::Set(stat, Nan::New(thumbnail_symbol), thumb);
+		}
 		info.GetReturnValue().Set(stat);
 	}
 
+	// A source that suspends the decode when it runs out of data, keeping the bytes libjpeg
+	// hasn't consumed yet for the next push.
+	struct JpegStreamSource : public jpeg_source_mgr {
+		std::vector<JOCTET> buffer;
+
+		// Bytes libjpeg skipped past the end of the data so far.
+		size_t skip;
+
+		JpegStreamSource() : skip(0) {
+			init_source = initSource;
+			fill_input_buffer = suspend;
+			skip_input_data = skipData;
+			resync_to_restart = jpeg_resync_to_restart;
+			term_source = termSource;
+			next_input_byte = 0;
+			bytes_in_buffer = 0;
+		}
+
+		void append(const JOCTET * data, size_t len) {
+			size_t skipped = std::min(skip, len);
+			skip -= skipped;
+			buffer.erase(buffer.begin(), buffer.end() - bytes_in_buffer);
+			buffer.insert(buffer.end(), data + skipped, data + len);
+			next_input_byte = buffer.empty() ? 0 : &buffer[0];
+			bytes_in_buffer = buffer.size();
+		}
+
+		static boolean suspend(j_decompress_ptr cinfo) { return FALSE; }
+
+		static void skipData(j_decompress_ptr cinfo, long num_bytes) {
+			JpegStreamSource * src = static_cast<JpegStreamSource*>(cinfo->src);
+			if (num_bytes <= 0)
+				return;
+			size_t n = std::min(size_t(num_bytes), src->bytes_in_buffer);
+			src->next_input_byte += n;
+			src->bytes_in_buffer -= n;
+			src->skip += size_t(num_bytes) - n;
+		}
+	};
+
+	// Decodes with a suspending source, picking up each step of the decode where the last
+	// push ran out of data.
+	struct JpegStreamDecoder : public StreamDecoder {
+		JpegReader reader;
+		JpegStreamSource source;
+		JpegDecodeOptions opts;
+		enum { HEADER, START, ROWS, FINISH, DONE } state;
+
+		JpegStreamDecoder(const JpegDecodeOptions & o) : opts(o), state(HEADER) {
+			reader.create();
+			reader.cinfo.src = &source;
+		}
+
+		void push(const char * data, size_t len) {
+			if (state == DONE)
+				return;
+			source.append((const JOCTET*)data, len);
+
+			// configure() sets its own jump, so the header has one of its own.
+			if (state == HEADER) {
+				if (setjmp(reader.jmpbuf)) {
+					fail();
+					return;
+				}
+				if (jpeg_read_header(&reader.cinfo, true) == JPEG_SUSPENDED)
+					return;
+				reader.header();
+				reader.configure(opts);
+				if (reader.error) {
+					fail();
+					return;
+				}
+				if (reader.getPixel() == INVALID_PIXEL) {
+					error = strdup("Unsupported jpeg image color space");
+					state = DONE;
+					return;
+				}
+				allocate(reader.width(), reader.height(), reader.getPixel());
+				if (image.data == 0) {
+					error = strdup("out of memory");
+					state = DONE;
+					return;
+				}
+				state = START;
+			}
+
+			if (setjmp(reader.jmpbuf)) {
+				fail();
+				return;
+			}
+			if (state == START) {
+				if (!jpeg_start_decompress(&reader.cinfo))
+					return;
+				state = ROWS;
+			}
+			while (state == ROWS && rows < image.height) {
+				if (!reader.readRow(image, rows, 0))
+					return;
+				++rows;
+			}
+			if (state == ROWS)
+				state = FINISH;
+			if (state == FINISH) {
+				if (!jpeg_finish_decompress(&reader.cinfo))
+					return;
+				state = DONE;
+			}
+		}
+
+		void fail() {
+			error = reader.error;
+			reader.error = 0;
+			state = DONE;
+		}
+	};
+
+	StreamDecoder * newJpegStreamDecoder(Local<Object> opts) {
+		JpegDecodeOptions o;
+		if (!getJpegDecodeOptions(o, opts))
+			return 0;
+
+		// Regions, thumbnails and previews need the whole file to hand.
+		o.crop = false;
+		o.thumbnail = 0;
+		o.maxscans = 0;
+		return new JpegStreamDecoder(o);
+	}
+
 
 	//------------------------------------------------------------------------------------------------------------
 	//--
 
-	struct JpegEncodeCtx {
-		JpegEncodeCtx() : error(0), dstdata(0) {}
+	struct JpegEncodeOptions {
+		JpegEncodeOptions() : quality(85), speed(JPEG_ACCURATE), threads(1), optimize(false), progressive(false),
+			chromah(2), chromav(2), restart(0), targetbytes(0), targetssim(0) {}
+		float quality;
+		JpegSpeed speed;
 
-		char *error;
-		jmp_buf jmpbuf;
+		// Threads to encode bands of rows on, separated by restart markers.
+		int threads;
 
-		Nan::Persistent<Value> buffer;
-		Nan::Persistent<Function> cb;
+		// Huffman tables fitted to the image, and progressive scans, both cost a pass
+		// over the coefficients but make smaller files.
+		bool optimize, progressive;
 
-		NativeImage image;
+		// Luma samples per chroma sample across and down.
+		int chromah, chromav;
 
-		uint8_t *dstdata;
-		size_t dstlen;
-		float quality;
+		// Rows of iMCUs between restart markers, or zero for none.
+		int restart;
 
-		void doWork();
+		// Search for the highest quality that fits in targetbytes, or the lowest that
+		// reaches targetssim, instead of using 'quality'.
+		double targetbytes, targetssim;
 
-		static void onError(j_common_ptr cinfo) {
-			char errbuf[JMSG_LENGTH_MAX];
-			JpegEncodeCtx* self = (JpegEncodeCtx*)cinfo->client_data;
-			cinfo->err->format_message(cinfo, errbuf);
-			self->error = strdup(errbuf);
-			longjmp(self->jmpbuf, 1);
-		}
+		// The size of an iMCU, which bands of a parallel encode are made of.
+		int mcuWidth(PixelMode pixel) const { return pixel == GREY_PIXEL ? DCTSIZE : chromah * DCTSIZE; }
+		int mcuHeight(PixelMode pixel) const { return pixel == GREY_PIXEL ? DCTSIZE : chromav * DCTSIZE; }
 	};
 
+	bool getJpegEncodeOptions(JpegEncodeOptions & o, Local<Object> opts) {
+		Local<Value> v = Nan::Get(opts, Nan::New(quality_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		double quality = v->NumberValue(Nan::GetCurrentContext()).FromMaybe(0);
+		if (quality != quality)
+			quality = 85;
+		else if (quality < 0)
+			quality = 0;
+		else if (quality > 100)
+			quality = 100;
+		o.quality = quality;
+
+		v = Nan::Get(opts, Nan::New(optimize_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		o.optimize = v->ToBoolean(v8::Isolate::GetCurrent())->Value();
+		v = Nan::Get(opts, Nan::New(progressive_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		o.progressive = v->ToBoolean(v8::Isolate::GetCurrent())->Value();
+
+		v = Nan::Get(opts, Nan::New(subsampling_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			if (v->StrictEquals(Nan::New<String>("4:2:0").ToLocalChecked())) {
+				o.chromah = 2;
+				o.chromav = 2;
+			}
+			else if (v->StrictEquals(Nan::New<String>("4:2:2").ToLocalChecked())) {
+				o.chromah = 2;
+				o.chromav = 1;
+			}
+			else if (v->StrictEquals(Nan::New<String>("4:4:4").ToLocalChecked())) {
+				o.chromah = 1;
+				o.chromav = 1;
+			}
+			else {
+				Nan::ThrowError("invalid subsampling");
+				return false;
+			}
+		}
+
+		v = Nan::Get(opts, Nan::New(restart_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			o.restart = v->Int32Value(Nan::GetCurrentContext()).FromMaybe(-1);
+			if (o.restart < 0) {
+				Nan::ThrowError("invalid restart interval");
+				return false;
+			}
+		}
+
+		v = Nan::Get(opts, Nan::New(targetBytes_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			o.targetbytes = v->NumberValue(Nan::GetCurrentContext()).FromMaybe(0);
+			if (!(o.targetbytes > 0)) {
+				Nan::ThrowError("invalid targetBytes");
+				return false;
+			}
+		}
+		v = Nan::Get(opts, Nan::New(targetSsim_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			o.targetssim = v->NumberValue(Nan::GetCurrentContext()).FromMaybe(0);
+			if (!(o.targetssim > 0 && o.targetssim <= 1) || o.targetbytes > 0) {
+				Nan::ThrowError("invalid targetSsim");
+				return false;
+			}
+		}
+
+		// Trial encodes of a search run side by side.
+		if (o.targetbytes > 0 || o.targetssim > 0)
+			o.threads = availableThreads();
+
+		return getJpegSpeed(o.speed, opts) && getJpegThreads(o.threads, opts);
+	}
+
 	namespace {
 
+		// Compressed data goes to a chunked buffer. The first block is sized from an
+		// estimate of the output, and later blocks double the total, so nothing is copied
+		// until the end, and not at all when the estimate holds. Blocks that go to a sink
+		// as they fill stay small instead.
 		struct JpegDst : public jpeg_destination_mgr {
-			JpegDst() : size(0), buf(0) {
+			JpegDst() : estimate(16 * 1024), space(0) {
 				init_destination = initDest_;
 				empty_output_buffer = emptyOutput_;
 				term_destination = termDest_;
 			}
 
-			static void initDest_(j_compress_ptr cinfo) { static_cast<JpegDst*>(cinfo->dest)->initDest(); }
-			void initDest() {
-				size = 4 * 4096;
-				buf = reinterpret_cast<unsigned char*>(malloc(size));
-				next_output_byte = buf;
-				free_in_buffer = size;
+			static void initDest_(j_compress_ptr cinfo) { static_cast<JpegDst*>(cinfo->dest)->initDest(cinfo); }
+			void initDest(j_compress_ptr cinfo) {
+				next_output_byte = reinterpret_cast<JOCTET*>(buffer.next_(estimate, space));
+				if (next_output_byte == NULL) ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+				free_in_buffer = space;
 			}
 
 			static boolean emptyOutput_(j_compress_ptr cinfo) { return static_cast<JpegDst*>(cinfo->dest)->emptyOutput(cinfo); }
 			boolean emptyOutput(j_compress_ptr cinfo) {
-				unsigned long nextsize = size * 2;
-				unsigned char * nextbuffer = reinterpret_cast<unsigned char*>(malloc(nextsize));
-				if (nextbuffer == NULL) ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
-				memcpy(nextbuffer, buf, size);
-				free(buf);
-				buf = nextbuffer;
-				next_output_byte = buf + size;
-				free_in_buffer = nextsize - size;
-				size = nextsize;
+				buffer.advance_(space);
+				next_output_byte = reinterpret_cast<JOCTET*>(buffer.next_(buffer.sink ? WriteBuffer::min_block : buffer.totallen, space));
+				if (next_output_byte == NULL) ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+				free_in_buffer = space;
 				return TRUE;
 			}
 
 			static void termDest_(j_compress_ptr cinfo) { static_cast<JpegDst*>(cinfo->dest)->termDest(); }
 			void termDest() {
-				size -= free_in_buffer;
+				buffer.advance_(space - free_in_buffer);
 			}
 
-			unsigned long size;
-			unsigned char *buf;
+			size_t estimate;
+			size_t space;
+			WriteBuffer buffer;
 		};
+
+		// A generous guess at the compressed size, in bytes. Subsampled colour carries
+		// about two samples per pixel.
+		size_t jpegSizeEstimate(int width, int height, int components, float quality) {
+			double q = quality / 100;
+			double samples = double(width) * height * (components == 1 ? 1 : 2);
+			return 1024 + size_t(samples * (0.05 + 0.4 * q * q * q));
+		}
 	}
 
-	void JpegEncodeCtx::doWork() {
+	// An image converted to YCbCr and downsampled exactly as libjpeg would, and padded
+	// to whole iMCUs, so trial encodes can share the conversion through raw data input.
+	struct JpegPlanes {
+		int components;
+		int width, height, rows;
+		int stride[3], vsamp[3];
+		std::vector<JSAMPLE> data[3];
+
+		JSAMPROW row(int c, int y) { return &data[c][size_t(y) * stride[c]]; }
+		const JSAMPLE * row(int c, int y) const { return &data[c][size_t(y) * stride[c]]; }
+
+		void convert(const NativeImage & image, const JpegEncodeOptions & opts);
+	};
+
+	void JpegPlanes::convert(const NativeImage & image, const JpegEncodeOptions & opts) {
+		const int imcuw = opts.mcuWidth(image.pixel), imcuh = opts.mcuHeight(image.pixel);
+		const int mcus = (image.width + imcuw - 1) / imcuw;
+		width = image.width;
+		height = image.height;
+		rows = (image.height + imcuh - 1) / imcuh;
+		components = image.pixel == GREY_PIXEL ? 1 : 3;
+		for (int c = 0; c < components; ++c) {
+			int hs = c == 0 ? imcuw / DCTSIZE : 1;
+			vsamp[c] = c == 0 ? imcuh / DCTSIZE : 1;
+			stride[c] = mcus * hs * DCTSIZE;
+			data[c].resize(size_t(stride[c]) * rows * vsamp[c] * DCTSIZE);
+		}
+
+		// Full size rows, with the right edge replicated across the padding, and a group
+		// of vs rows of full size chroma for each row of downsampled chroma.
+		const int hs = imcuw / DCTSIZE, vs = imcuh / DCTSIZE;
+		const int fullwidth = stride[0];
+		const int chromarows = (image.height + vs - 1) / vs;
+		std::vector<JSAMPLE> full(4 * fullwidth);
+		for (int cy = 0; cy < rows * DCTSIZE; ++cy) {
+			for (int k = 0; k < vs; ++k) {
+				const uint8_t * src = reinterpret_cast<const uint8_t*>(image.row(std::min(cy * vs + k, image.height - 1)));
+				JSAMPLE * yrow = row(0, cy * vs + k);
+				if (components == 1) {
+					for (int x = 0; x < fullwidth; ++x)
+						yrow[x] = src[std::min(x, image.width - 1)];
+					continue;
+				}
+
+				// libjpeg's rgb_ycc_convert, in 16 bit fixed point.
+				JSAMPLE * cb = &full[(2 * k) * fullwidth], * cr = &full[(2 * k + 1) * fullwidth];
+				for (int x = 0; x < fullwidth; ++x) {
+					const uint8_t * p = src + 3 * std::min(x, image.width - 1);
+					int32_t r = p[0], g = p[1], b = p[2];
+					yrow[x] = JSAMPLE((19595 * r + 38470 * g + 7471 * b + 32768) >> 16);
+					cb[x] = JSAMPLE((-11059 * r - 21709 * g + 32768 * b + (128 << 16) + 32767) >> 16);
+					cr[x] = JSAMPLE((32768 * r - 27439 * g - 5329 * b + (128 << 16) + 32767) >> 16);
+				}
+			}
+			if (components == 1)
+				continue;
+
+			// Downsample as h2v1_downsample and h2v2_downsample do, with their alternating
+			// rounding bias. Rows below the image repeat the last downsampled row.
+			for (int c = 1; c < 3; ++c) {
+				JSAMPLE * out = row(c, cy);
+				if (cy >= chromarows) {
+					memcpy(out, row(c, chromarows - 1), stride[c]);
+					continue;
+				}
+				const JSAMPLE * a = &full[(c - 1) * fullwidth];
+				const JSAMPLE * b = &full[(2 * (vs - 1) + c - 1) * fullwidth];
+				if (hs == 1)
+					memcpy(out, a, stride[c]);
+				else if (vs == 1) {
+					for (int x = 0; x < stride[c]; ++x)
+						out[x] = JSAMPLE((a[2 * x] + a[2 * x + 1] + (x & 1)) >> 1);
+				}
+				else {
+					for (int x = 0; x < stride[c]; ++x)
+						out[x] = JSAMPLE((a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1] + 1 + (x & 1)) >> 2);
+				}
+			}
+		}
+	}
+
+	// The mean structural similarity of two 8 bit planes, over 8x8 windows every 4 pixels.
+	double planeSsim(const JSAMPLE * a, int astride, const JSAMPLE * b, int bstride, int width, int height) {
+		const double c1 = (0.01 * 255) * (0.01 * 255), c2 = (0.03 * 255) * (0.03 * 255);
+		const int n = 64;
+		double total = 0;
+		int count = 0;
+		for (int y = 0; y + 8 <= height; y += 4) {
+			for (int x = 0; x + 8 <= width; x += 4) {
+				int64_t sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+				for (int j = 0; j < 8; ++j) {
+					const JSAMPLE * pa = a + size_t(y + j) * astride + x;
+					const JSAMPLE * pb = b + size_t(y + j) * bstride + x;
+					for (int i = 0; i < 8; ++i) {
+						int va = pa[i], vb = pb[i];
+						sa += va;
+						sb += vb;
+						saa += va * va;
+						sbb += vb * vb;
+						sab += va * vb;
+					}
+				}
+				double ma = double(sa) / n, mb = double(sb) / n;
+				double va = double(saa) / n - ma * ma, vb = double(sbb) / n - mb * mb, cov = double(sab) / n - ma * mb;
+				total += (2 * ma * mb + c1) * (2 * cov + c2) / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+				++count;
+			}
+		}
+		return count ? total / count : 1;
+	}
+
+	// Compresses an image, or one band of it. Trial encodes take the image as planes
+	// already converted to YCbCr.
+	struct JpegEncoder {
+		JpegEncoder() : error(0), dstdata(0), dstlen(0), sink(0) {}
+		~JpegEncoder() { if (error) free(error); if (dstdata) free(dstdata); }
+
+		char *error;
+		jmp_buf jmpbuf;
+
+		uint8_t *dstdata;
+		size_t dstlen;
+
+		// Where the jpeg goes as it is written, instead of into dstdata.
+		WriteBuffer::Sink * sink;
+
+		void encode(const NativeImage & image, const JpegEncodeOptions & opts, int restart, const JpegPlanes * planes = 0);
+		void encode(const NativeImage & image, const JpegEncodeOptions & opts, const JpegPlanes * planes = 0);
+
+		static void onError(j_common_ptr cinfo) {
+			char errbuf[JMSG_LENGTH_MAX];
+			JpegEncoder* self = (JpegEncoder*)cinfo->client_data;
+			cinfo->err->format_message(cinfo, errbuf);
+			self->error = strdup(errbuf);
+			longjmp(self->jmpbuf, 1);
+		}
+	};
+
+	void JpegEncoder::encode(const NativeImage & image, const JpegEncodeOptions & opts, int restart, const JpegPlanes * planes) {
 		jpeg_compress_struct cinfo;
 		jpeg_error_mgr jerr;
 		JpegDst jdst;
 
 		cinfo.err = jpeg_std_error(&jerr);
-		cinfo.err->error_exit = &JpegEncodeCtx::onError;
+		cinfo.err->error_exit = &JpegEncoder::onError;
+		cinfo.client_data = this;
         jpeg_create_compress(&cinfo);
 
+		if (setjmp(jmpbuf)) {
+			jpeg_destroy_compress(&cinfo);
+			return;
+		}
+
 		cinfo.dest = &jdst;
+		jdst.buffer.sink = sink;
 
 		if (image.pixel == GREY_PIXEL) {
 	        cinfo.input_components = 1;
@@ -352,21 +1354,305 @@ namespace picha {
 		}
         cinfo.image_width = (JDIMENSION)image.width;
         cinfo.image_height = (JDIMENSION)image.height;
+		jdst.estimate = sink ? WriteBuffer::min_block : jpegSizeEstimate(image.width, image.height, cinfo.input_components, opts.quality);
 
         jpeg_set_defaults(&cinfo);
-        jpeg_set_quality(&cinfo, quality, true);
+        jpeg_set_quality(&cinfo, opts.quality, true);
+		if (opts.speed != JPEG_ACCURATE)
+			cinfo.dct_method = JDCT_IFAST;
+		if (cinfo.in_color_space != JCS_GRAYSCALE) {
+			cinfo.comp_info[0].h_samp_factor = opts.chromah;
+			cinfo.comp_info[0].v_samp_factor = opts.chromav;
+		}
+		cinfo.optimize_coding = opts.optimize;
+		if (opts.progressive)
+			jpeg_simple_progression(&cinfo);
+		cinfo.restart_interval = restart;
+		cinfo.raw_data_in = planes != 0;
         jpeg_start_compress(&cinfo, true);
 
-		for (int y = 0; y < image.height; ++y) {
-			char * p = image.row(y);
-			jpeg_write_scanlines(&cinfo, (JSAMPARRAY)(&p), 1);
+		if (planes) {
+			JSAMPROW rows[3][2 * DCTSIZE];
+			JSAMPARRAY arrays[3] = { rows[0], rows[1], rows[2] };
+			for (int y = 0; y < planes->rows; ++y) {
+				for (int c = 0; c < planes->components; ++c) {
+					int lines = planes->vsamp[c] * DCTSIZE;
+					for (int i = 0; i < lines; ++i)
+						rows[c][i] = const_cast<JSAMPROW>(planes->row(c, y * lines + i));
+				}
+				jpeg_write_raw_data(&cinfo, arrays, planes->vsamp[0] * DCTSIZE);
+			}
+		}
+		else {
+			for (int y = 0; y < image.height; ++y) {
+				char * p = image.row(y);
+				jpeg_write_scanlines(&cinfo, (JSAMPARRAY)(&p), 1);
+			}
 		}
 
         jpeg_finish_compress(&cinfo);
 		jpeg_destroy_compress(&cinfo);
 
-		dstdata = reinterpret_cast<uint8_t*>(jdst.buf);
-		dstlen = jdst.size;
+		dstlen = jdst.buffer.totallen;
+		if (sink)
+			jdst.buffer.flush_();
+		else if (!(dstdata = reinterpret_cast<uint8_t*>(jdst.buffer.consolidate_())))
+			error = strdup("out of memory");
+	}
+
+	// A whole image, restarting every opts.restart rows.
+	void JpegEncoder::encode(const NativeImage & image, const JpegEncodeOptions & opts, const JpegPlanes * planes) {
+		int mcus = (image.width + opts.mcuWidth(image.pixel) - 1) / opts.mcuWidth(image.pixel);
+		encode(image, opts, int(std::min(int64_t(opts.restart) * mcus, int64_t(65535))), planes);
+	}
+
+	// Trial encodes at a set of qualities, scoring each by size or by the similarity of
+	// its decoded luma to the original's.
+	struct JpegTrials {
+		const NativeImage & image;
+		const JpegEncodeOptions & opts;
+		const JpegPlanes & planes;
+		std::vector<int> qualities;
+		std::vector<JpegEncoder> * encoders;
+		std::vector<double> ssims;
+
+		JpegTrials(const NativeImage & i, const JpegEncodeOptions & o, const JpegPlanes & p)
+			: image(i), opts(o), planes(p), encoders(0) {}
+
+		void operator()(int trial) {
+			JpegEncodeOptions o = opts;
+			o.quality = float(qualities[trial]);
+			JpegEncoder & encoder = (*encoders)[trial];
+			encoder.encode(image, o, &planes);
+			if (encoder.error || opts.targetssim <= 0)
+				return;
+
+			JpegDecodeOptions d;
+			d.pixel = GREY_PIXEL;
+			d.threads = 1;
+			JpegReader reader;
+			reader.open(reinterpret_cast<char*>(encoder.dstdata), encoder.dstlen);
+			if (!reader.error)
+				reader.configure(d);
+			NativeImage luma = newNativeImage(image.width, image.height, GREY_PIXEL);
+			if (!reader.error)
+				reader.decode(luma);
+			if (reader.error)
+				std::swap(encoder.error, reader.error);
+			else
+				ssims[trial] = planeSsim(planes.row(0, 0), planes.stride[0], reinterpret_cast<JSAMPLE*>(luma.data), luma.stride, image.width, image.height);
+			freeNativeImage(luma);
+		}
+	};
+
+	struct JpegEncodeBands {
+		const NativeImage & image;
+		const JpegEncodeOptions & opts;
+		std::vector<JpegEncoder> & encoders;
+		int bandheight, restart;
+
+		JpegEncodeBands(const NativeImage & i, const JpegEncodeOptions & o, std::vector<JpegEncoder> & e, int h, int r)
+			: image(i), opts(o), encoders(e), bandheight(h), restart(r) {}
+
+		void operator()(int band) {
+			NativeImage rows = image;
+			rows.data = image.row(band * bandheight);
+			rows.height = std::min(bandheight, image.height - band * bandheight);
+			encoders[band].encode(rows, opts, restart);
+		}
+	};
+
+	struct JpegEncodeCtx {
+		JpegEncodeCtx() : error(0), dstdata(0), time(0), quality(0), ssim(0), stream(0) {}
+		~JpegEncodeCtx() { delete stream; }
+
+		char *error;
+
+		Nan::Persistent<Value> buffer;
+		Nan::Persistent<Function> cb;
+
+		NativeImage image;
+		JpegEncodeOptions opts;
+		Nan::Persistent<Object> report;
+
+		uint8_t *dstdata;
+		size_t dstlen;
+
+		// Milliseconds spent encoding.
+		double time;
+
+		// The quality and similarity a search settled on.
+		int quality;
+		double ssim;
+
+		// Where the jpeg goes as it is written, instead of into dstdata. Only a single
+		// encoder writes as it goes, bands and searches pass on the whole jpeg at the end.
+		ChunkStream * stream;
+
+		void doWork();
+		void encode();
+		void search();
+		void stitch(std::vector<JpegEncoder> & encoders);
+		void setReport(Local<Object> r);
+	};
+
+	void JpegEncodeCtx::doWork() {
+		uint64_t start = uv_hrtime();
+		encode();
+		time = (uv_hrtime() - start) / 1e6;
+		if (stream && dstdata) {
+			stream->block(reinterpret_cast<char*>(dstdata), dstlen);
+			dstdata = 0;
+		}
+	}
+
+	void JpegEncodeCtx::encode() {
+		if (opts.targetbytes > 0 || opts.targetssim > 0) {
+			search();
+			return;
+		}
+
+		// Bands need a single set of Huffman tables and a single scan.
+		const int imcuw = opts.mcuWidth(image.pixel), imcuh = opts.mcuHeight(image.pixel);
+		const int mcus = (image.width + imcuw - 1) / imcuw;
+		const int rows = (image.height + imcuh - 1) / imcuh;
+		const int restart = std::max(1, opts.restart);
+		int bands = int(std::min(int64_t(std::min(opts.threads, rows)), int64_t(image.width) * image.height / JpegMinBandPixels));
+		if (bands < 2 || opts.optimize || opts.progressive || int64_t(restart) * mcus > 65535) {
+			JpegEncoder encoder;
+			encoder.sink = stream;
+			encoder.encode(image, opts);
+			std::swap(error, encoder.error);
+			std::swap(dstdata, encoder.dstdata);
+			dstlen = encoder.dstlen;
+			return;
+		}
+
+		// Bands are whole restart intervals.
+		int bandrows = ((rows + bands - 1) / bands + restart - 1) / restart * restart;
+		bands = (rows + bandrows - 1) / bandrows;
+		std::vector<JpegEncoder> encoders(bands);
+		JpegEncodeBands job(image, opts, encoders, bandrows * imcuh, restart * mcus);
+		parallelFor(bands, bands, job);
+
+		for (int i = 0; i < bands; ++i) {
+			if (encoders[i].error) {
+				std::swap(error, encoders[i].error);
+				return;
+			}
+		}
+		stitch(encoders);
+	}
+
+	// Search the qualities for the highest whose jpeg fits in targetbytes, or the lowest
+	// that reaches targetssim, failing if none does. Each round encodes up to 'threads'
+	// qualities spread across the range still in doubt, from planes converted once.
+	void JpegEncodeCtx::search() {
+		JpegPlanes planes;
+		planes.convert(image, opts);
+
+		// Qualities up to 'lo' are below the target, and from 'hi' on reach it.
+		const bool bytes = opts.targetbytes > 0;
+		int lo = 0, hi = 101;
+		std::vector<JpegEncoder> chosen(1);
+		while (hi - lo > 1) {
+			int n = std::min(std::max(1, opts.threads), hi - lo - 1);
+			JpegTrials job(image, opts, planes);
+			std::vector<JpegEncoder> encoders(n);
+			job.encoders = &encoders;
+			job.ssims.resize(n);
+			for (int i = 0; i < n; ++i)
+				job.qualities.push_back(lo + (i + 1) * (hi - lo) / (n + 1));
+			parallelFor(n, n, job);
+
+			int nlo = lo, nhi = hi;
+			for (int i = 0; i < n; ++i) {
+				if (encoders[i].error) {
+					std::swap(error, encoders[i].error);
+					return;
+				}
+				int q = job.qualities[i];
+				bool reached = bytes ? encoders[i].dstlen > opts.targetbytes : job.ssims[i] >= opts.targetssim;
+				if (reached)
+					nhi = std::min(nhi, q);
+				else
+					nlo = std::max(nlo, q);
+			}
+
+			// Keep the jpeg that will be the answer if the range closes on it: the
+			// highest fitting quality for a size, the lowest reaching one for similarity.
+			int keep = bytes ? (nlo > 0 ? nlo : nhi) : (nhi < 101 ? nhi : nlo);
+			for (int i = 0; i < n; ++i) {
+				if (job.qualities[i] == keep) {
+					std::swap(chosen[0].dstdata, encoders[i].dstdata);
+					std::swap(chosen[0].dstlen, encoders[i].dstlen);
+					quality = keep;
+					ssim = job.ssims[i];
+				}
+			}
+			lo = nlo;
+			hi = nhi;
+		}
+
+		if (bytes ? lo == 0 : hi == 101) {
+			error = strdup("target not reachable");
+			return;
+		}
+		std::swap(dstdata, chosen[0].dstdata);
+		dstlen = chosen[0].dstlen;
+	}
+
+	// Each band is a jpeg of its own, restarting every opts.restart rows of iMCUs, or
+	// every row by default, which keeps the bands small for a parallel decode. The first
+	// band's headers, with the full height, go before the segments of every band,
+	// renumbered to run on across the bands.
+	void JpegEncodeCtx::stitch(std::vector<JpegEncoder> & encoders) {
+		const int bands = int(encoders.size());
+		std::vector<std::vector<JpegSegment> > segments(bands);
+		size_t sof, entropy, total = 0;
+		for (int i = 0; i < bands; ++i) {
+			if (!jpegHeaderOffsets(encoders[i].dstdata, encoders[i].dstlen, sof, entropy) ||
+					!jpegSegments(encoders[i].dstdata, encoders[i].dstlen, entropy, segments[i])) {
+				error = strdup("failed to join jpeg bands");
+				return;
+			}
+			for (size_t s = 0; s < segments[i].size(); ++s)
+				total += segments[i][s].end - segments[i][s].start + 2;
+		}
+		jpegHeaderOffsets(encoders[0].dstdata, encoders[0].dstlen, sof, entropy);
+		total += entropy;
+
+		dstdata = reinterpret_cast<uint8_t*>(malloc(total));
+		if (!dstdata) {
+			error = strdup("out of memory");
+			return;
+		}
+		memcpy(dstdata, encoders[0].dstdata, entropy);
+		jpegSetHeight(dstdata, sof, image.height);
+		uint8_t * p = dstdata + entropy;
+		int index = 0;
+		for (int i = 0; i < bands; ++i) {
+			for (size_t s = 0; s < segments[i].size(); ++s, ++index) {
+				if (index > 0) {
+					*p++ = 0xFF;
+					*p++ = JOCTET(0xD0 + (index - 1) % 8);
+				}
+				size_t len = segments[i][s].end - segments[i][s].start;
+				memcpy(p, encoders[i].dstdata + segments[i][s].start, len);
+				p += len;
+			}
+		}
+		*p++ = 0xFF;
+		*p++ = 0xD9;
+		dstlen = p - dstdata;
+	}
+
+	void JpegEncodeCtx::setReport(Local<Object> r) {
+		Nan::Set(r, Nan::New(size_symbol), Nan::New<Number>(double(dstlen)));
+		Nan::Set(r, Nan::New(time_symbol), Nan::New<Number>(time));
+		Nan::Set(r, Nan::New(quality_symbol), Nan::New<Number>(quality ? quality : opts.quality));
+		if (opts.targetssim > 0)
+			Nan::Set(r, Nan::New(ssim_symbol), Nan::New<Number>(ssim));
 	}
 
 	void UV_encodeJpeg(uv_work_t* work_req) {
@@ -382,8 +1668,13 @@ namespace picha {
 		size_t dstlen = ctx->dstlen;
 		uint8_t * dstdata = ctx->dstdata;
 		Local<Function> cb = Nan::New(ctx->cb);
+		if (ctx->stream)
+			ctx->stream->close();
+		if (!error && !ctx->report.IsEmpty())
+			ctx->setReport(Nan::New(ctx->report));
 		ctx->buffer.Reset();
 		ctx->cb.Reset();
+		ctx->report.Reset();
 		delete work_req;
 		delete ctx;
 
@@ -395,7 +1686,7 @@ namespace picha {
 		else {
 			Local<Object> o;
 			e = Nan::Undefined();
-			if (Nan::NewBuffer(reinterpret_cast<char*>(dstdata), dstlen).ToLocal(&o)) {
+			if (dstdata && Nan::NewBuffer(reinterpret_cast<char*>(dstdata), dstlen).ToLocal(&o)) {
 				dstdata = 0;
 				r = o;
 			}
@@ -419,8 +1710,9 @@ namespace picha {
 	}
 
 	NAN_METHOD(encodeJpeg) {
-		if (info.Length() != 3 || !info[0]->IsObject() || !info[1]->IsObject() || !info[2]->IsFunction()) {
-			Nan::ThrowError("expected: encodeJpeg(image, opts, cb)");
+		if (info.Length() < 3 || info.Length() > 4 || !info[0]->IsObject() || !info[1]->IsObject() || !info[2]->IsFunction() ||
+				(info.Length() == 4 && !info[3]->IsFunction())) {
+			Nan::ThrowError("expected: encodeJpeg(image, opts, cb[, chunkcb])");
 			return;
 		}
 		MaybeLocal<Object> mimg = info[0]->ToObject(Nan::GetCurrentContext());
@@ -431,14 +1723,9 @@ namespace picha {
 		Local<Object> opts = mopts.ToLocalChecked();
 		Local<Function> cb = Local<Function>::Cast(info[2]);
 
-		Local<Value> v = Nan::Get(opts, Nan::New(quality_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
-		double quality = v->NumberValue(Nan::GetCurrentContext()).FromMaybe(0);
-		if (quality != quality)
-			quality = 85;
-		else if (quality < 0)
-			quality = 0;
-		else if (quality > 100)
-			quality = 100;
+		JpegEncodeOptions eopts;
+		if (!getJpegEncodeOptions(eopts, opts))
+			return;
 
 		JpegEncodeCtx * ctx = new JpegEncodeCtx;
 		ctx->image = jsImageToNativeImage(img);
@@ -448,9 +1735,16 @@ namespace picha {
 			return;
 		}
 
-		ctx->quality = quality;
+		ctx->opts = eopts;
+		Local<Value> report = Nan::Get(opts, Nan::New(report_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (report->IsObject())
+			ctx->report.Reset(Local<Object>::Cast(report));
 		ctx->buffer.Reset(Nan::Get(img, Nan::New(data_symbol)).FromMaybe(Local<Value>(Nan::Undefined())));
 		ctx->cb.Reset(cb);
+		if (info.Length() == 4) {
+			ctx->stream = new ChunkStream(Local<Function>::Cast(info[3]));
+			info.GetReturnValue().Set(ctx->stream->resumer());
+		}
 
 		uv_work_t* work_req = new uv_work_t();
 		work_req->data = ctx;
@@ -469,14 +1763,9 @@ namespace picha {
 		Local<Object> img = mimg.ToLocalChecked();
 		Local<Object> opts = mopts.ToLocalChecked();
 
-		Local<Value> v = Nan::Get(opts, Nan::New(quality_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
-		double quality = v->NumberValue(Nan::GetCurrentContext()).FromMaybe(0);
-		if (quality != quality)
-			quality = 85;
-		else if (quality < 0)
-			quality = 0;
-		else if (quality > 100)
-			quality = 100;
+		JpegEncodeOptions eopts;
+		if (!getJpegEncodeOptions(eopts, opts))
+			return;
 
 		JpegEncodeCtx ctx;
 		ctx.image = jsImageToNativeImage(img);
@@ -485,9 +1774,13 @@ namespace picha {
 			return;
 		}
 
-		ctx.quality = quality;
+		ctx.opts = eopts;
 		ctx.doWork();
 
+		Local<Value> report = Nan::Get(opts, Nan::New(report_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!ctx.error && report->IsObject())
+			ctx.setReport(Local<Object>::Cast(report));
+
 		Local<Value> r;
 		if (ctx.error) {
 			Nan::ThrowError(ctx.error);
@@ -509,6 +1802,405 @@ namespace picha {
 		info.GetReturnValue().Set(r);
 	}
 
+	//------------------------------------------------------------------------------------------------------------
+	//--
+
+	// Lossless transforms work on the DCT coefficients, as jpegtran does. Any mix of
+	// transpose, rotate and flip reduces to an optional transpose followed by flips
+	// of the output axes.
+	struct JpegTransform {
+		JpegTransform() : transpose(false), fliph(false), flipv(false), crop(false), quality(0), optimize(false) {}
+		bool transpose, fliph, flipv;
+
+		// The crop is in the source image, before the rotation and flips.
+		bool crop;
+		int cropx, cropy, cropwidth, cropheight;
+
+		// Requantize the coefficients to the tables for this quality, or zero to keep them.
+		int quality;
+
+		// Fit the Huffman tables to the output, which takes a pass over the coefficients.
+		bool optimize;
+
+		void addTranspose() { transpose = !transpose; std::swap(fliph, flipv); }
+		void addRotate(int degrees) {
+			if (degrees == 90) { addTranspose(); fliph = !fliph; }
+			else if (degrees == 180) { fliph = !fliph; flipv = !flipv; }
+			else if (degrees == 270) { addTranspose(); flipv = !flipv; }
+		}
+	};
+
+	bool getJpegTransform(JpegTransform & t, Local<Object> opts) {
+		Local<Value> v = Nan::Get(opts, Nan::New(crop_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			MaybeLocal<Object> mcrop = v->ToObject(Nan::GetCurrentContext());
+			if (mcrop.IsEmpty())
+				return false;
+			Local<Object> crop = mcrop.ToLocalChecked();
+			t.crop = true;
+			t.cropx = Nan::Get(crop, Nan::New(x_symbol)).FromMaybe(Local<Value>(Nan::Undefined()))->Int32Value(Nan::GetCurrentContext()).FromMaybe(-1);
+			t.cropy = Nan::Get(crop, Nan::New(y_symbol)).FromMaybe(Local<Value>(Nan::Undefined()))->Int32Value(Nan::GetCurrentContext()).FromMaybe(-1);
+			t.cropwidth = Nan::Get(crop, Nan::New(width_symbol)).FromMaybe(Local<Value>(Nan::Undefined()))->Int32Value(Nan::GetCurrentContext()).FromMaybe(0);
+			t.cropheight = Nan::Get(crop, Nan::New(height_symbol)).FromMaybe(Local<Value>(Nan::Undefined()))->Int32Value(Nan::GetCurrentContext()).FromMaybe(0);
+			if (t.cropx < 0 || t.cropy < 0 || t.cropwidth <= 0 || t.cropheight <= 0) {
+				Nan::ThrowError("invalid crop");
+				return false;
+			}
+		}
+		v = Nan::Get(opts, Nan::New(transpose_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (v->ToBoolean(v8::Isolate::GetCurrent())->Value())
+			t.addTranspose();
+		v = Nan::Get(opts, Nan::New(rotate_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			int degrees = v->Int32Value(Nan::GetCurrentContext()).FromMaybe(-1);
+			if (degrees != 0 && degrees != 90 && degrees != 180 && degrees != 270) {
+				Nan::ThrowError("invalid rotation");
+				return false;
+			}
+			t.addRotate(degrees);
+		}
+		v = Nan::Get(opts, Nan::New(flip_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			if (v->StrictEquals(Nan::New(horizontal_symbol)))
+				t.fliph = !t.fliph;
+			else if (v->StrictEquals(Nan::New(vertical_symbol)))
+				t.flipv = !t.flipv;
+			else {
+				Nan::ThrowError("invalid flip");
+				return false;
+			}
+		}
+		v = Nan::Get(opts, Nan::New(quality_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			t.quality = v->Int32Value(Nan::GetCurrentContext()).FromMaybe(0);
+			if (t.quality < 1 || t.quality > 100) {
+				Nan::ThrowError("invalid quality");
+				return false;
+			}
+		}
+		v = Nan::Get(opts, Nan::New(optimize_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		t.optimize = v->IsUndefined() ? t.quality > 0 : v->ToBoolean(v8::Isolate::GetCurrent())->Value();
+		return true;
+	}
+
+	// Rescale a row of coefficient blocks from one quantization table to another by the
+	// ratio of their steps, rounding half away from zero.
+	void requantizeBlocks(JBLOCKROW blocks, int count, const float * ratio) {
+		for (int b = 0; b < count; ++b) {
+			JCOEF * d = blocks[b];
+			for (int k = 0; k < DCTSIZE2; ++k) {
+				float v = d[k] * ratio[k];
+				d[k] = JCOEF(v + std::copysign(0.5f, v));
+			}
+		}
+	}
+
+	struct JpegTransformCtx {
+		JpegTransformCtx() : compressing(false), dstdata(0) {}
+
+		Nan::Persistent<Value> buffer;
+		Nan::Persistent<Function> cb;
+
+		// Errors from both the source and destination land in the reader.
+		JpegReader reader;
+		JpegTransform transform;
+		jpeg_compress_struct dstinfo;
+		jpeg_error_mgr jerr;
+		JpegDst jdst;
+		bool compressing;
+
+		uint8_t *dstdata;
+		size_t dstlen;
+
+		void doWork();
+		void finish();
+		void close() {
+			if (compressing) jpeg_destroy_compress(&dstinfo);
+			compressing = false;
+		}
+		~JpegTransformCtx() { close(); }
+	};
+
+	void JpegTransformCtx::doWork() {
+		jpeg_decompress_struct & srcinfo = reader.cinfo;
+		if (setjmp(reader.jmpbuf)) {
+			close();
+			return;
+		}
+
+		const bool t = transform.transpose;
+		const int imcuw = srcinfo.max_h_samp_factor * DCTSIZE;
+		const int imcuh = srcinfo.max_v_samp_factor * DCTSIZE;
+		const int width = srcinfo.image_width, height = srcinfo.image_height;
+
+		// The region moves up and left to the iMCU grid, keeping its far corner. Edges
+		// that a flip moves to the origin are trimmed to whole iMCUs, as jpegtran -trim.
+		int x = 0, y = 0, w = width, h = height;
+		if (transform.crop) {
+			if (int64_t(transform.cropx) + transform.cropwidth > width || int64_t(transform.cropy) + transform.cropheight > height) {
+				reader.error = strdup("crop outside the image");
+				return;
+			}
+			x = transform.cropx / imcuw * imcuw;
+			y = transform.cropy / imcuh * imcuh;
+			w = transform.cropx + transform.cropwidth - x;
+			h = transform.cropy + transform.cropheight - y;
+		}
+		if (t ? transform.flipv : transform.fliph)
+			w = w / imcuw * imcuw;
+		if (t ? transform.fliph : transform.flipv)
+			h = h / imcuh * imcuh;
+		if (w == 0 || h == 0) {
+			reader.error = strdup("image too small to transform");
+			return;
+		}
+
+		// Destination coefficient arrays come from the source's memory manager, so they
+		// have to be requested before the source coefficients are read and realized. With
+		// nothing to move, the source arrays are written back out as they are.
+		const bool identity = !t && !transform.fliph && !transform.flipv && w == width && h == height;
+		const int components = srcinfo.num_components;
+		std::vector<jvirt_barray_ptr> dstarrays(components);
+		for (int c = 0; c < components && !identity; ++c) {
+			jpeg_component_info * comp = &srcinfo.comp_info[c];
+			int hs = t ? comp->v_samp_factor : comp->h_samp_factor;
+			int vs = t ? comp->h_samp_factor : comp->v_samp_factor;
+			int maxh = t ? srcinfo.max_v_samp_factor : srcinfo.max_h_samp_factor;
+			int maxv = t ? srcinfo.max_h_samp_factor : srcinfo.max_v_samp_factor;
+			JDIMENSION bw = (JDIMENSION)(((t ? h : w) * hs + maxh * DCTSIZE - 1) / (maxh * DCTSIZE));
+			JDIMENSION bh = (JDIMENSION)(((t ? w : h) * vs + maxv * DCTSIZE - 1) / (maxv * DCTSIZE));
+			dstarrays[c] = (*srcinfo.mem->request_virt_barray)((j_common_ptr)&srcinfo, JPOOL_IMAGE, TRUE,
+				(bw + hs - 1) / hs * hs, (bh + vs - 1) / vs * vs, vs);
+		}
+
+		jvirt_barray_ptr * srcarrays = jpeg_read_coefficients(&srcinfo);
+
+		dstinfo.err = jpeg_std_error(&jerr);
+		dstinfo.err->error_exit = &JpegReader::onError;
+		dstinfo.client_data = &reader;
+		jpeg_create_compress(&dstinfo);
+		compressing = true;
+		dstinfo.dest = &jdst;
+		jdst.estimate = reader.srclen;
+
+		jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
+		dstinfo.image_width = t ? h : w;
+		dstinfo.image_height = t ? w : h;
+		if (t) {
+			for (int c = 0; c < components; ++c)
+				std::swap(dstinfo.comp_info[c].h_samp_factor, dstinfo.comp_info[c].v_samp_factor);
+			for (int q = 0; q < NUM_QUANT_TBLS; ++q) {
+				JQUANT_TBL * qtbl = dstinfo.quant_tbl_ptrs[q];
+				if (!qtbl) continue;
+				for (int i = 0; i < DCTSIZE; ++i)
+					for (int j = 0; j < i; ++j)
+						std::swap(qtbl->quantval[i * DCTSIZE + j], qtbl->quantval[j * DCTSIZE + i]);
+			}
+		}
+
+		// Requantizing swaps in the standard tables for the quality, never finer than the
+		// source's, and rescales each coefficient to them.
+		UINT16 oldq[NUM_QUANT_TBLS][DCTSIZE2];
+		float ratios[MAX_COMPONENTS][DCTSIZE2];
+		if (transform.quality > 0) {
+			for (int q = 0; q < NUM_QUANT_TBLS; ++q) {
+				if (dstinfo.quant_tbl_ptrs[q])
+					memcpy(oldq[q], dstinfo.quant_tbl_ptrs[q]->quantval, sizeof(oldq[q]));
+			}
+			std::vector<bool> used(NUM_QUANT_TBLS);
+			for (int c = 0; c < components; ++c)
+				used[dstinfo.comp_info[c].quant_tbl_no] = true;
+			const int luma = dstinfo.comp_info[0].quant_tbl_no;
+
+			jpeg_set_quality(&dstinfo, transform.quality, TRUE);
+			UINT16 stdq[2][DCTSIZE2];
+			memcpy(stdq[0], dstinfo.quant_tbl_ptrs[0]->quantval, sizeof(stdq[0]));
+			memcpy(stdq[1], dstinfo.quant_tbl_ptrs[1]->quantval, sizeof(stdq[1]));
+			for (int q = 0; q < NUM_QUANT_TBLS; ++q) {
+				if (!used[q])
+					continue;
+				UINT16 * quantval = dstinfo.quant_tbl_ptrs[q]->quantval;
+				for (int k = 0; k < DCTSIZE2; ++k)
+					quantval[k] = std::max(oldq[q][k], stdq[q == luma ? 0 : 1][k]);
+			}
+
+			for (int c = 0; c < components; ++c) {
+				const int q = dstinfo.comp_info[c].quant_tbl_no;
+				for (int k = 0; k < DCTSIZE2; ++k)
+					ratios[c][k] = float(oldq[q][k]) / dstinfo.quant_tbl_ptrs[q]->quantval[k];
+			}
+		}
+
+		dstinfo.optimize_coding = transform.optimize;
+
+		if (identity) {
+			if (transform.quality > 0) {
+				for (int c = 0; c < components; ++c) {
+					jpeg_component_info * comp = &srcinfo.comp_info[c];
+					int rows = (comp->height_in_blocks + comp->v_samp_factor - 1) / comp->v_samp_factor * comp->v_samp_factor;
+					int cols = (comp->width_in_blocks + comp->h_samp_factor - 1) / comp->h_samp_factor * comp->h_samp_factor;
+					for (int by = 0; by < rows; by += comp->v_samp_factor) {
+						JBLOCKARRAY blocks = (*srcinfo.mem->access_virt_barray)((j_common_ptr)&srcinfo, srcarrays[c], by, comp->v_samp_factor, TRUE);
+						for (int r = 0; r < comp->v_samp_factor; ++r)
+							requantizeBlocks(blocks[r], cols, ratios[c]);
+					}
+				}
+			}
+			jpeg_write_coefficients(&dstinfo, srcarrays);
+			finish();
+			return;
+		}
+
+		// Each destination block comes from the source block it lands on, transposed and
+		// with the odd frequencies of the flipped axes negated.
+		for (int c = 0; c < components; ++c) {
+			jpeg_component_info * comp = &srcinfo.comp_info[c];
+			int hs = comp->h_samp_factor, vs = comp->v_samp_factor;
+			int offx = x / imcuw * hs, offy = y / imcuh * vs;
+			int srcw = (comp->width_in_blocks + hs - 1) / hs * hs;
+			int srch = (comp->height_in_blocks + vs - 1) / vs * vs;
+			int regionw = int((int64_t(w) * hs + imcuw - 1) / imcuw);
+			int regionh = int((int64_t(h) * vs + imcuh - 1) / imcuh);
+			int outw = t ? regionh : regionw, outh = t ? regionw : regionh;
+			int dsths = t ? vs : hs, dstvs = t ? hs : vs;
+			int dstw = (outw + dsths - 1) / dsths * dsths, dsth = (outh + dstvs - 1) / dstvs * dstvs;
+
+			for (int by = 0; by < dsth; ++by) {
+				JBLOCKROW dstrow = (*srcinfo.mem->access_virt_barray)((j_common_ptr)&srcinfo, dstarrays[c], by, 1, TRUE)[0];
+				int fy = transform.flipv ? outh - 1 - by : by;
+				for (int bx = 0; bx < dstw; ++bx) {
+					int fx = transform.fliph ? outw - 1 - bx : bx;
+					int sx = (t ? fy : fx) + offx, sy = (t ? fx : fy) + offy;
+					JCOEF * d = dstrow[bx];
+					if (sx >= srcw || sy >= srch) {
+						memset(d, 0, sizeof(JBLOCK));
+						continue;
+					}
+					const JCOEF * s = (*srcinfo.mem->access_virt_barray)((j_common_ptr)&srcinfo, srcarrays[c], sy, 1, FALSE)[0][sx];
+					for (int i = 0; i < DCTSIZE; ++i) {
+						for (int j = 0; j < DCTSIZE; ++j) {
+							JCOEF v = t ? s[j * DCTSIZE + i] : s[i * DCTSIZE + j];
+							bool negate = (transform.fliph && (j & 1)) != (transform.flipv && (i & 1));
+							d[i * DCTSIZE + j] = negate ? JCOEF(-v) : v;
+						}
+					}
+					if (transform.quality > 0)
+						requantizeBlocks(dstrow + bx, 1, ratios[c]);
+				}
+			}
+		}
+
+		jpeg_write_coefficients(&dstinfo, &dstarrays[0]);
+		finish();
+	}
+
+	void JpegTransformCtx::finish() {
+		jpeg_decompress_struct & srcinfo = reader.cinfo;
+
+		// Keep the colour profile.
+		for (jpeg_saved_marker_ptr m = srcinfo.marker_list; m; m = m->next)
+			jpeg_write_marker(&dstinfo, m->marker, m->data, m->data_length);
+
+		jpeg_finish_compress(&dstinfo);
+		jpeg_finish_decompress(&srcinfo);
+
+		dstlen = jdst.buffer.totallen;
+		dstdata = reinterpret_cast<uint8_t*>(jdst.buffer.consolidate_());
+		if (!dstdata && !reader.error)
+			reader.error = strdup("out of memory");
+		close();
+	}
+
+	void UV_transformJpeg(uv_work_t* work_req) {
+		JpegTransformCtx *ctx = reinterpret_cast<JpegTransformCtx*>(work_req->data);
+		ctx->doWork();
+	}
+
+	void V8_transformJpeg(uv_work_t* work_req, int) {
+		Nan::HandleScope scope;
+		JpegTransformCtx *ctx = reinterpret_cast<JpegTransformCtx*>(work_req->data);
+
+		Local<Value> r = Nan::Undefined();
+		Local<Object> o;
+		if (!ctx->reader.error && Nan::NewBuffer(reinterpret_cast<char*>(ctx->dstdata), ctx->dstlen).ToLocal(&o)) {
+			ctx->dstdata = 0;
+			r = o;
+		}
+		makeCallback(Nan::New(ctx->cb), ctx->reader.error, r);
+
+		if (ctx->dstdata)
+			free(ctx->dstdata);
+		ctx->buffer.Reset();
+		ctx->cb.Reset();
+		delete work_req;
+		delete ctx;
+	}
+
+	NAN_METHOD(transformJpeg) {
+		if (info.Length() != 3 || !Buffer::HasInstance(info[0]) || !info[1]->IsObject() || !info[2]->IsFunction()) {
+			Nan::ThrowError("expected: transformJpeg(srcbuffer, opts, cb)");
+			return;
+		}
+		MaybeLocal<Object> msrcbuf = info[0]->ToObject(Nan::GetCurrentContext());
+		MaybeLocal<Object> mopts = info[1]->ToObject(Nan::GetCurrentContext());
+		if (msrcbuf.IsEmpty() || mopts.IsEmpty())
+			return;
+		Local<Object> srcbuf = msrcbuf.ToLocalChecked();
+		Local<Function> cb = Local<Function>::Cast(info[2]);
+
+		JpegTransformCtx * ctx = new JpegTransformCtx;
+		if (!getJpegTransform(ctx->transform, mopts.ToLocalChecked())) {
+			delete ctx;
+			return;
+		}
+
+		ctx->reader.open(Buffer::Data(srcbuf), Buffer::Length(srcbuf), true);
+		if (ctx->reader.error) {
+			makeCallback(cb, ctx->reader.error, Nan::Undefined());
+			delete ctx;
+			return;
+		}
+
+		ctx->buffer.Reset(srcbuf);
+		ctx->cb.Reset(cb);
+
+		uv_work_t* work_req = new uv_work_t();
+		work_req->data = ctx;
+		uv_queue_work(uv_default_loop(), work_req, UV_transformJpeg, V8_transformJpeg);
+	}
+
+	NAN_METHOD(transformJpegSync) {
+		if (info.Length() != 2 || !Buffer::HasInstance(info[0]) || !info[1]->IsObject()) {
+			Nan::ThrowError("expected: transformJpegSync(srcbuffer, opts)");
+			return;
+		}
+		MaybeLocal<Object> msrcbuf = info[0]->ToObject(Nan::GetCurrentContext());
+		MaybeLocal<Object> mopts = info[1]->ToObject(Nan::GetCurrentContext());
+		if (msrcbuf.IsEmpty() || mopts.IsEmpty())
+			return;
+		Local<Object> srcbuf = msrcbuf.ToLocalChecked();
+
+		JpegTransformCtx ctx;
+		if (!getJpegTransform(ctx.transform, mopts.ToLocalChecked()))
+			return;
+
+		ctx.reader.open(Buffer::Data(srcbuf), Buffer::Length(srcbuf), true);
+		if (!ctx.reader.error)
+			ctx.doWork();
+		if (ctx.reader.error) {
+			Nan::ThrowError(ctx.reader.error);
+			return;
+		}
+
+		Local<Object> o;
+		if (Nan::NewBuffer(reinterpret_cast<char*>(ctx.dstdata), ctx.dstlen).ToLocal(&o)) {
+			ctx.dstdata = 0;
+			info.GetReturnValue().Set(o);
+		}
+		if (ctx.dstdata)
+			free(ctx.dstdata);
+	}
+
 	std::vector<PixelMode> getJpegEncodes() {
 		return std::vector<PixelMode>({ RGB_PIXEL, GREY_PIXEL });
 	}
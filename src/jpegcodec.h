@@ -5,12 +5,17 @@
 
 namespace picha {
 
+	struct StreamDecoder;
+
 	NAN_METHOD(statJpeg);
 	NAN_METHOD(decodeJpeg);
 	NAN_METHOD(decodeJpegSync);
 	NAN_METHOD(encodeJpeg);
 	NAN_METHOD(encodeJpegSync);
+	NAN_METHOD(transformJpeg);
+	NAN_METHOD(transformJpegSync);
 	std::vector<PixelMode> getJpegEncodes();
+	StreamDecoder * newJpegStreamDecoder(Local<Object> opts);
 
 }
 
@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <uv.h>
+
+#include "parallel.h"
+
+namespace picha {
+
+	//---------------------------------------------------------------------------------------------------------
+
+	int availableThreads() {
+		int n = int(uv_available_parallelism());
+		return n < 1 ? 1 : n;
+	}
+
+	namespace {
+
+		struct ParallelState {
+			ParallelWork * work;
+			int count;
+			std::atomic<int> next;
+
+			// Helper threads still wanted, and those still running, guarded by the pool lock.
+			int wanted;
+			int active;
+		};
+
+		void runWorker(ParallelState * state) {
+			for (int i = state->next++; i < state->count; i = state->next++)
+				state->work->run(i);
+		}
+
+		// One pool of helper threads, a core short of the machine, shared by every
+		// parallel job in the process however many libuv workers start them. A job gets
+		// the helpers that are free and its calling thread does the rest, so it never
+		// waits on a helper to start.
+		struct ThreadPool {
+			uv_mutex_t lock;
+			uv_cond_t queued;
+			uv_cond_t finished;
+			std::deque<ParallelState*> jobs;
+
+			ThreadPool() {
+				uv_mutex_init(&lock);
+				uv_cond_init(&queued);
+				uv_cond_init(&finished);
+				for (int t = availableThreads() - 1; t > 0; --t) {
+					uv_thread_t tid;
+					uv_thread_create(&tid, helper, this);
+				}
+			}
+
+			static void helper(void * arg) {
+				ThreadPool * pool = reinterpret_cast<ThreadPool*>(arg);
+				uv_mutex_lock(&pool->lock);
+				for (;;) {
+					while (pool->jobs.empty())
+						uv_cond_wait(&pool->queued, &pool->lock);
+					ParallelState * state = pool->jobs.front();
+					if (--state->wanted == 0)
+						pool->jobs.pop_front();
+					++state->active;
+					uv_mutex_unlock(&pool->lock);
+
+					runWorker(state);
+
+					uv_mutex_lock(&pool->lock);
+					if (--state->active == 0)
+						uv_cond_broadcast(&pool->finished);
+				}
+			}
+
+			void run(ParallelState & state) {
+				uv_mutex_lock(&lock);
+				jobs.push_back(&state);
+				uv_cond_broadcast(&queued);
+				uv_mutex_unlock(&lock);
+
+				runWorker(&state);
+
+				// Take back the helpers nobody picked up, then wait for those that did.
+				uv_mutex_lock(&lock);
+				if (state.wanted > 0)
+					jobs.erase(std::find(jobs.begin(), jobs.end(), &state));
+				while (state.active > 0)
+					uv_cond_wait(&finished, &lock);
+				uv_mutex_unlock(&lock);
+			}
+		};
+
+		uv_once_t poolOnce = UV_ONCE_INIT;
+		ThreadPool * pool = 0;
+
+		void startPool() {
+			pool = new ThreadPool;
+		}
+
+	}
+
+	void runParallel(ParallelWork& work, int count, int threads) {
+		ParallelState state;
+		state.work = &work;
+		state.count = count;
+		state.next = 0;
+		state.wanted = std::min(std::min(threads, count) - 1, availableThreads() - 1);
+		state.active = 0;
+
+		if (state.wanted <= 0) {
+			runWorker(&state);
+			return;
+		}
+
+		uv_once(&poolOnce, startPool);
+		pool->run(state);
+	}
+
+}
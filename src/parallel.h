@@ -0,0 +1,36 @@
+#ifndef picha_parallel_h_
+#define picha_parallel_h_
+
+#include "picha.h"
+
+namespace picha {
+
+	//----------------------------------------------------------------------------------------------------------------
+	//--
+
+	// The number of threads worth running a single job on.
+	int availableThreads();
+
+	struct ParallelWork {
+		virtual ~ParallelWork() {}
+		virtual void run(int index) = 0;
+	};
+
+	// Run work.run(0 .. count - 1) on up to 'threads' threads: the calling thread and
+	// whichever threads of a shared pool are free. Returns once every index has completed.
+	void runParallel(ParallelWork& work, int count, int threads);
+
+	template <typename F> struct ParallelFunctor : public ParallelWork {
+		F& f;
+		ParallelFunctor(F& f_) : f(f_) {}
+		void run(int index) { f(index); }
+	};
+
+	template <typename F> void parallelFor(int count, int threads, F& f) {
+		ParallelFunctor<F> w(f);
+		runParallel(w, count, threads);
+	}
+
+}
+
+#endif // picha_parallel_h_
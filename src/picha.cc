@@ -5,6 +5,7 @@
 #include "picha.h"
 #include "resize.h"
 #include "colorconvert.h"
+#include "streamdecoder.h"
 
 #ifdef WITH_PNG
 #include "pngcodec.h"
@@ -133,7 +134,7 @@ namespace picha {
 	}
 
 
-	void makeCallback(Local<Function> cb, const char * error, Local<Value> v) {
+	Local<Value> makeCallback(Local<Function> cb, const char * error, Local<Value> v) {
 		Local<Value> argv[2] = { Nan::Undefined(), v };
 		if (error) {
 			argv[0] = Nan::Error(error);
@@ -142,10 +143,13 @@ namespace picha {
 		Nan::TryCatch try_catch;
 
 		Nan::AsyncResource ass("picha");
-		ass.runInAsyncScope(Nan::GetCurrentContext()->Global(), cb, 2, argv);
+		Local<Value> r;
+		if (!ass.runInAsyncScope(Nan::GetCurrentContext()->Global(), cb, 2, argv).ToLocal(&r))
+			r = Nan::Undefined();
 
 		if (try_catch.HasCaught())
 			FatalException(try_catch);
+		return r;
 	}
 
 	v8::Local<v8::Function> SetPichaMethod(v8::Local<v8::Object> o, const char * n, NAN_METHOD((*cb))) {
@@ -183,6 +187,10 @@ namespace picha {
 
 		Nan::SetMethod(target, "resize", resize);
 		Nan::SetMethod(target, "resizeSync", resizeSync);
+		Nan::SetMethod(target, "resizeCacheStats", resizeCacheStats);
+
+		initStreamDecoder();
+		Nan::SetMethod(target, "createDecoder", createDecoder);
 
 #ifdef WITH_JPEG
 
@@ -198,6 +206,8 @@ namespace picha {
 		Nan::Set(obj, Nan::New(encode_symbol), fn);
 		fn = SetPichaMethod(target, "encodeJpegSync", encodeJpegSync);
 		Nan::Set(obj, Nan::New(encodeSync_symbol), fn);
+		SetPichaMethod(target, "transformJpeg", transformJpeg);
+		SetPichaMethod(target, "transformJpegSync", transformJpegSync);
 		encodes = pixelMap(getJpegEncodes());
 		Nan::Set(obj, Nan::New(encodes_symbol), encodes);
 
@@ -63,6 +63,66 @@ namespace picha {
 	SSYMBOL(alphaQuality)\
 	SSYMBOL(exact)\
 	SSYMBOL(deep)\
+	SSYMBOL(threads)\
+	SSYMBOL(precision)\
+	SSYMBOL(fast)\
+	SSYMBOL(accurate)\
+	SSYMBOL(reduce)\
+	SSYMBOL(hits)\
+	SSYMBOL(misses)\
+	SSYMBOL(entries)\
+	SSYMBOL(capacity)\
+	SSYMBOL(maxWidth)\
+	SSYMBOL(maxHeight)\
+	SSYMBOL(scale)\
+	SSYMBOL(scales)\
+	SSYMBOL(region)\
+	SSYMBOL(x)\
+	SSYMBOL(y)\
+	SSYMBOL(rotate)\
+	SSYMBOL(flip)\
+	SSYMBOL(transpose)\
+	SSYMBOL(crop)\
+	SSYMBOL(horizontal)\
+	SSYMBOL(vertical)\
+	SSYMBOL(speed)\
+	SSYMBOL(speeds)\
+	SSYMBOL(draft)\
+	SSYMBOL(optimize)\
+	SSYMBOL(progressive)\
+	SSYMBOL(subsampling)\
+	SSYMBOL(restart)\
+	SSYMBOL(report)\
+	SSYMBOL(size)\
+	SSYMBOL(time)\
+	SSYMBOL(targetBytes)\
+	SSYMBOL(targetSsim)\
+	SSYMBOL(ssim)\
+	SSYMBOL(thumbnail)\
+	SSYMBOL(preferEmbeddedThumbnail)\
+	SSYMBOL(maxScans)\
+	SSYMBOL(compressionLevel)\
+	SSYMBOL(strategy)\
+	SSYMBOL(filters)\
+	SSYMBOL(windowBits)\
+	SSYMBOL(memLevel)\
+	SSYMBOL(filtered)\
+	SSYMBOL(huffman)\
+	SSYMBOL(rle)\
+	SSYMBOL(fixed)\
+	SSYMBOL(sub)\
+	SSYMBOL(up)\
+	SSYMBOL(average)\
+	SSYMBOL(paeth)\
+	SSYMBOL(all)\
+	SSYMBOL(fastest)\
+	SSYMBOL(smallest)\
+	SSYMBOL(palette)\
+	SSYMBOL(dither)\
+	SSYMBOL(colors)\
+	SSYMBOL(brute)\
+	SSYMBOL(trusted)\
+	SSYMBOL(rows)\
 	/**/
 
 #	define SSYMBOL(a) extern Nan::Persistent<String> a ## _symbol;
@@ -70,7 +130,9 @@ namespace picha {
 #	undef SSYMBOL
 
 	inline Local<String> makeSymbol(const char *n) { return Nan::New(n).ToLocalChecked(); }
-	void makeCallback(Local<Function> cb, const char * error, Local<Value> v);
+
+	// Call cb(error, v) and return what it returns.
+	Local<Value> makeCallback(Local<Function> cb, const char * error, Local<Value> v);
 
 
 	//--------------------------------------------------------------------------------------------------
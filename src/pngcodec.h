@@ -5,12 +5,15 @@
 
 namespace picha {
 
+	struct StreamDecoder;
+
 	NAN_METHOD(statPng);
 	NAN_METHOD(decodePng);
 	NAN_METHOD(decodePngSync);
 	NAN_METHOD(encodePng);
 	NAN_METHOD(encodePngSync);
 	std::vector<PixelMode> getPngEncodes();
+	StreamDecoder * newPngStreamDecoder(Local<Object> opts);
 
 }
 
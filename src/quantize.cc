@@ -0,0 +1,258 @@
+#include <string.h>
+#include <algorithm>
+
+#include "quantize.h"
+
+namespace picha {
+
+	namespace {
+
+		inline void readRgba(const uint8_t * p, int channels, int * c) {
+			switch (channels) {
+				case 1: c[0] = c[1] = c[2] = p[0]; c[3] = 255; break;
+				case 2: c[0] = c[1] = c[2] = p[0]; c[3] = p[1]; break;
+				case 3: c[0] = p[0]; c[1] = p[1]; c[2] = p[2]; c[3] = 255; break;
+				default: c[0] = p[0]; c[1] = p[1]; c[2] = p[2]; c[3] = p[3]; break;
+			}
+		}
+
+		inline uint32_t packRgba(const int * c) {
+			return uint32_t(c[0]) | uint32_t(c[1]) << 8 | uint32_t(c[2]) << 16 | uint32_t(c[3]) << 24;
+		}
+
+		// An open addressed table of the distinct colours in an image, which gives up once
+		// there are more than 'max' of them.
+		struct ColorTable {
+			static const int Bits = 10;
+			static const int Size = 1 << Bits;
+
+			uint32_t keys[Size];
+			int16_t slots[Size];
+			std::vector<uint32_t> colors;
+			int max;
+
+			ColorTable(int m) : max(m) { memset(slots, -1, sizeof(slots)); }
+
+			// The index of the colour, adding it if there's room, or -1.
+			int index(uint32_t c) {
+				for (uint32_t h = (c * 2654435761u) >> (32 - Bits); ; h = (h + 1) & (Size - 1)) {
+					if (slots[h] < 0) {
+						if (int(colors.size()) == max)
+							return -1;
+						keys[h] = c;
+						slots[h] = int16_t(colors.size());
+						colors.push_back(c);
+						return slots[h];
+					}
+					if (keys[h] == c)
+						return slots[h];
+				}
+			}
+		};
+
+		// The histogram keeps 5 bits of each colour channel and 3 of alpha.
+		static const int HistogramBits = 18;
+
+		inline int histogramKey(const int * c) {
+			return (c[0] >> 3) << 13 | (c[1] >> 3) << 8 | (c[2] >> 3) << 3 | (c[3] >> 5);
+		}
+
+		struct HistogramEntry {
+			uint64_t count;
+			uint64_t sum[4];
+			int mean[4];
+		};
+
+		struct EntryAxis {
+			int axis;
+			EntryAxis(int a) : axis(a) {}
+			bool operator()(const HistogramEntry & a, const HistogramEntry & b) const { return a.mean[axis] < b.mean[axis]; }
+		};
+
+		// A box of histogram entries in the median cut, and the channel it spans the most.
+		struct CutBox {
+			int begin, end;
+			uint64_t count;
+			int axis, range;
+
+			CutBox(std::vector<HistogramEntry> & entries, int b, int e) : begin(b), end(e), count(0), axis(0), range(0) {
+				int lo[4] = { 255, 255, 255, 255 }, hi[4] = { 0, 0, 0, 0 };
+				for (int i = begin; i < end; ++i) {
+					count += entries[i].count;
+					for (int k = 0; k < 4; ++k) {
+						lo[k] = std::min(lo[k], entries[i].mean[k]);
+						hi[k] = std::max(hi[k], entries[i].mean[k]);
+					}
+				}
+				for (int k = 0; k < 4; ++k) {
+					if (hi[k] - lo[k] > range) {
+						range = hi[k] - lo[k];
+						axis = k;
+					}
+				}
+			}
+
+			// Boxes covering many pixels over a wide range of colour split first.
+			double score() const { return end - begin < 2 ? 0 : double(range) * double(count); }
+		};
+
+		struct NearestColor {
+			const std::vector<uint8_t> & palette;
+			std::vector<int16_t> cache;
+
+			NearestColor(const std::vector<uint8_t> & p) : palette(p), cache(size_t(1) << HistogramBits, -1) {}
+
+			// The nearest entry to the colour, cached for the colour's histogram bucket.
+			int operator()(const int * c) {
+				int16_t & n = cache[histogramKey(c)];
+				if (n < 0) {
+					int best = 0x7fffffff;
+					for (size_t i = 0; i < palette.size(); i += 4) {
+						int d = 0;
+						for (int k = 0; k < 4; ++k)
+							d += (c[k] - palette[i + k]) * (c[k] - palette[i + k]);
+						if (d < best) {
+							best = d;
+							n = int16_t(i / 4);
+						}
+					}
+				}
+				return n;
+			}
+		};
+
+		bool exactColors(const NativeImage & image, int maxcolors, QuantizedImage & out) {
+			const int channels = pixelChannels(image.pixel);
+			ColorTable table(maxcolors);
+			uint8_t * dst = &out.indices[0];
+			for (int y = 0; y < image.height; ++y) {
+				const uint8_t * p = reinterpret_cast<const uint8_t*>(image.row(y));
+				for (int x = 0; x < image.width; ++x, p += channels) {
+					int c[4];
+					readRgba(p, channels, c);
+					int i = table.index(packRgba(c));
+					if (i < 0)
+						return false;
+					*dst++ = uint8_t(i);
+				}
+			}
+			out.palette.resize(table.colors.size() * 4);
+			for (size_t i = 0; i < table.colors.size(); ++i) {
+				for (int k = 0; k < 4; ++k)
+					out.palette[i * 4 + k] = uint8_t(table.colors[i] >> (8 * k));
+			}
+			return true;
+		}
+
+		void medianCut(const NativeImage & image, int maxcolors, std::vector<uint8_t> & palette) {
+			const int channels = pixelChannels(image.pixel);
+			std::vector<int32_t> slots(size_t(1) << HistogramBits, -1);
+			std::vector<HistogramEntry> entries;
+			for (int y = 0; y < image.height; ++y) {
+				const uint8_t * p = reinterpret_cast<const uint8_t*>(image.row(y));
+				for (int x = 0; x < image.width; ++x, p += channels) {
+					int c[4];
+					readRgba(p, channels, c);
+					int32_t & s = slots[histogramKey(c)];
+					if (s < 0) {
+						s = int32_t(entries.size());
+						entries.push_back(HistogramEntry());
+						memset(&entries.back(), 0, sizeof(HistogramEntry));
+					}
+					HistogramEntry & e = entries[s];
+					e.count += 1;
+					for (int k = 0; k < 4; ++k)
+						e.sum[k] += c[k];
+				}
+			}
+			for (size_t i = 0; i < entries.size(); ++i) {
+				for (int k = 0; k < 4; ++k)
+					entries[i].mean[k] = int((entries[i].sum[k] + entries[i].count / 2) / entries[i].count);
+			}
+
+			// Split the box with the best score at the pixel weighted median of its widest
+			// channel, until there are enough boxes or none can split.
+			std::vector<CutBox> boxes;
+			boxes.push_back(CutBox(entries, 0, int(entries.size())));
+			while (int(boxes.size()) < maxcolors) {
+				size_t b = 0;
+				for (size_t i = 1; i < boxes.size(); ++i) {
+					if (boxes[i].score() > boxes[b].score())
+						b = i;
+				}
+				if (boxes[b].score() == 0)
+					break;
+				CutBox box = boxes[b];
+				std::sort(entries.begin() + box.begin, entries.begin() + box.end, EntryAxis(box.axis));
+				int split = box.begin + 1;
+				for (uint64_t half = 0; split < box.end - 1 && half + entries[split - 1].count <= box.count / 2; ++split)
+					half += entries[split - 1].count;
+				boxes[b] = CutBox(entries, box.begin, split);
+				boxes.push_back(CutBox(entries, split, box.end));
+			}
+
+			palette.resize(boxes.size() * 4);
+			for (size_t b = 0; b < boxes.size(); ++b) {
+				uint64_t sum[4] = { 0, 0, 0, 0 };
+				for (int i = boxes[b].begin; i < boxes[b].end; ++i) {
+					for (int k = 0; k < 4; ++k)
+						sum[k] += entries[i].sum[k];
+				}
+				for (int k = 0; k < 4; ++k)
+					palette[b * 4 + k] = uint8_t((sum[k] + boxes[b].count / 2) / boxes[b].count);
+			}
+		}
+
+		void mapColors(const NativeImage & image, bool dither, QuantizedImage & out) {
+			const int channels = pixelChannels(image.pixel);
+			NearestColor nearest(out.palette);
+			uint8_t * dst = &out.indices[0];
+
+			// Floyd-Steinberg errors in sixteenths, for this row and the next, with a pixel of
+			// padding at either end.
+			std::vector<int> errors(dither ? (image.width + 2) * 8 : 0);
+			int * cur = dither ? &errors[0] : 0, * next = dither ? &errors[(image.width + 2) * 4] : 0;
+
+			for (int y = 0; y < image.height; ++y) {
+				const uint8_t * p = reinterpret_cast<const uint8_t*>(image.row(y));
+				for (int x = 0; x < image.width; ++x, p += channels) {
+					int c[4];
+					readRgba(p, channels, c);
+					if (!dither) {
+						*dst++ = uint8_t(nearest(c));
+						continue;
+					}
+					int * e = cur + (x + 1) * 4;
+					for (int k = 0; k < 4; ++k)
+						c[k] = std::min(255, std::max(0, c[k] + ((e[k] + 8) >> 4)));
+					int n = nearest(c);
+					*dst++ = uint8_t(n);
+					int * below = next + (x + 1) * 4;
+					for (int k = 0; k < 4; ++k) {
+						int d = c[k] - out.palette[n * 4 + k];
+						e[4 + k] += d * 7;
+						below[k - 4] += d * 3;
+						below[k] += d * 5;
+						below[k + 4] += d;
+					}
+				}
+				if (dither) {
+					std::swap(cur, next);
+					memset(next, 0, (image.width + 2) * 4 * sizeof(int));
+				}
+			}
+		}
+
+	}
+
+	void quantizeImage(const NativeImage & image, int maxcolors, bool dither, QuantizedImage & out) {
+		out.indices.resize(size_t(image.width) * image.height);
+		out.palette.clear();
+		out.exact = out.indices.empty() || exactColors(image, maxcolors, out);
+		if (out.exact)
+			return;
+		medianCut(image, maxcolors, out.palette);
+		mapColors(image, dither, out);
+	}
+
+}
@@ -0,0 +1,36 @@
+#ifndef picha_quantize_h_
+#define picha_quantize_h_
+
+#include <stdint.h>
+#include <vector>
+
+#include "picha.h"
+
+namespace picha {
+
+	//----------------------------------------------------------------------------------------------------------------
+	//--
+
+	// An 8 bit image reduced to a palette of RGBA colours and an index per pixel.
+	struct QuantizedImage {
+		// Four bytes, RGBA, per entry.
+		std::vector<uint8_t> palette;
+
+		// Rows of image.width indices.
+		std::vector<uint8_t> indices;
+
+		// Whether the image had few enough colours to be indexed without loss.
+		bool exact;
+
+		int colors() const { return int(palette.size() / 4); }
+	};
+
+	// Index an 8 bit image with at most 'maxcolors' (up to 256) colours. An image with that
+	// many colours or fewer keeps them exactly. Otherwise the palette comes from a median
+	// cut of a histogram of the colours, and the pixels map to their nearest entry, with
+	// Floyd-Steinberg dithering if 'dither' is set.
+	void quantizeImage(const NativeImage & image, int maxcolors, bool dither, QuantizedImage & out);
+
+}
+
+#endif // picha_quantize_h_
@@ -1,13 +1,38 @@
 
 #include <string.h>
 #include <cmath>
+#include <list>
+#include <map>
+#include <memory>
 #include <vector>
 #include "resize.h"
+#include "parallel.h"
+#include "convolve.h"
 
 namespace picha {
 
 	using std::vector;
 
+	enum ResizeFilterTag {
+		CubicFilterTag,
+		LanczosFilterTag,
+		CatmulRomFilterTag,
+		MitchelFilterTag,
+		BoxFilterTag,
+		TriangleFilterTag,
+
+		InvalidFilterTag,
+	};
+
+	struct ResizeOptions {
+		ResizeOptions() : filter(CubicFilterTag), width(0.70f), threads(availableThreads()), fixed(false), reduce(false) {}
+		ResizeFilterTag filter;
+		float width;
+		int threads;
+		bool fixed;
+		bool reduce;
+	};
+
 	typedef vector<float> PixelContribs;
 
 	struct ContribRange {
@@ -16,14 +41,15 @@ namespace picha {
 
 	typedef vector<ContribRange> RangeVector;
 
+	// 'offset' shifts the sampling positions, in source pixels.
 	template <typename Filter> void makeContribs(RangeVector & ranges, const Filter & filter,
-		float scale, PixelContribs& storage, int size) {
+		float scale, PixelContribs& storage, int size, float offset = 0) {
 
 		float fscale(std::max(std::max(scale, 1.0f), 1.0f / filter.support()));
 		float fsupport(filter.support() * fscale);
 		float iscale(1.0f / fscale);
 
-		float center = float(0.5) * scale;
+		float center = float(0.5) * scale + offset;
 		for (RangeVector::iterator i = ranges.begin(); i != ranges.end(); ++i, center += scale) {
 			float totalweight(0);
 			int left = int(std::max(float(0), std::ceil(center - fsupport)));
@@ -49,11 +75,21 @@ namespace picha {
 		}
 	}
 
+	// Contributions for an axis that keeps its size, each destination pixel taking its
+	// source pixel unchanged.
+	void makeCopyContribs(RangeVector & ranges, PixelContribs& storage) {
+		for (size_t i = 0; i < ranges.size(); ++i) {
+			ranges[i].left = ranges[i].right = int(i);
+			ranges[i].weights = storage.size();
+			storage.push_back(1.0f);
+		}
+	}
+
 	struct FloatBuffer {
 		FloatBuffer(int w, int h, int d) {
 			width = w;
 			height = h;
-			stride = w * d;
+			stride = w * d + RowSlack;
 			data.resize(stride * height);
 		}
 
@@ -63,102 +99,366 @@ namespace picha {
 		vector<float> data;
 	};
 
-	template <PixelMode Pixel, typename Filter>
-	void resizeImagePixel(NativeImage & src, NativeImage & dst, const Filter & filter) {
-		assert(src.pixel == Pixel);
-		assert(dst.pixel == Pixel);
+	// Pad the horizontal weights of each destination pixel to the widest range, rounded
+	// up to a multiple of some number of taps.
+	void padContribs(PaddedContribs<float> & padded, const RangeVector & ranges, const PixelContribs & contribs, int size, int multiple = 1) {
+		padded.taps = 1;
+		for (RangeVector::const_iterator i = ranges.begin(); i != ranges.end(); ++i)
+			padded.taps = std::max(padded.taps, i->right - i->left + 1);
+		padded.taps = (padded.taps + multiple - 1) / multiple * multiple;
+
+		padded.left.resize(ranges.size());
+		padded.weights.assign(ranges.size() * padded.taps, 0.0f);
+		for (size_t x = 0; x < ranges.size(); ++x) {
+			const ContribRange & r = ranges[x];
+			int left = std::max(0, std::min(r.left, size - padded.taps));
+			padded.left[x] = left;
+			for (int c = r.left, w = r.weights; c <= r.right; ++c, ++w)
+				padded.weights[x * padded.taps + c - left] = contribs[w];
+		}
+	}
+
+	// Quantize a run of weights to fixed point. The rounding error is folded into the
+	// largest weight so the run still sums to exactly one.
+	void quantizeWeights(const float * w, int16_t * q, int n) {
+		const float one = float(1 << FixedWeightBits);
+		int sum = 0, big = 0;
+		for (int i = 0; i < n; ++i) {
+			q[i] = int16_t(std::max(-32768.0f, std::min(32767.0f, std::floor(w[i] * one + 0.5f))));
+			sum += q[i];
+			if (std::abs(w[i]) > std::abs(w[big]))
+				big = i;
+		}
+		q[big] = int16_t(q[big] + (1 << FixedWeightBits) - sum);
+	}
+
+	// Filter weights and ranges for resizing between two image sizes.
+	struct ResizeTables {
+		PixelContribs contribs;
+		RangeVector rowcontribs;
+		RangeVector columncontribs;
+		int ringrows;
+
+		// Axes that keep their size and skip filtering, and whether filtering the rows
+		// before the columns is the cheaper order.
+		bool rowcopy, columncopy;
+		bool rowsfirst;
+
+		// The row weights padded for the row kernels, and the weights quantized for the
+		// fixed point engine.
+		PaddedContribs<float> rowweights;
+		PaddedContribs<int16_t> fixedrowweights;
+		vector<int16_t> fixedcolumnweights;
+	};
+
+	void finishResizeTables(ResizeTables & tables, int srcwidth, int srcheight) {
+		padContribs(tables.rowweights, tables.rowcontribs, tables.contribs, srcwidth);
+
+		// Estimate the multiply-adds of filtering each source row down to the destination
+		// width before the columns, against filtering full width columns first.
+		double dstwidth = double(tables.rowcontribs.size()), dstheight = double(tables.columncontribs.size());
+		double rowtaps = tables.rowweights.taps, columntaps = 0;
+		for (RangeVector::const_iterator i = tables.columncontribs.begin(); i != tables.columncontribs.end(); ++i)
+			columntaps += i->right - i->left + 1;
+		double rowsfirstcost = srcheight * dstwidth * rowtaps + dstwidth * columntaps;
+		double columnsfirstcost = srcwidth * columntaps + dstheight * dstwidth * rowtaps;
+		tables.rowsfirst = !tables.rowcopy && (tables.columncopy || rowsfirstcost <= columnsfirstcost);
+
+		PaddedContribs<float> padded;
+		padContribs(padded, tables.rowcontribs, tables.contribs, srcwidth, FixedTapMultiple);
+		PaddedContribs<int16_t> & rowweights = tables.fixedrowweights;
+		rowweights.taps = padded.taps;
+		rowweights.left = padded.left;
+		rowweights.weights.resize(padded.weights.size());
+		for (size_t x = 0; x < padded.left.size(); ++x)
+			quantizeWeights(&padded.weights[x * padded.taps], &rowweights.weights[x * padded.taps], padded.taps);
+
+		tables.fixedcolumnweights.resize(tables.contribs.size());
+		for (RangeVector::const_iterator i = tables.columncontribs.begin(); i != tables.columncontribs.end(); ++i)
+			quantizeWeights(&tables.contribs[i->weights], &tables.fixedcolumnweights[i->weights], i->right - i->left + 1);
+	}
+
+	// Integer box reduction ahead of the filter for large downscales. The configured
+	// filter is always left at least ReduceGuard of the ratio, so the box averaging
+	// never decides the final look.
+	static const int MaxReduceFactor = 8;
+	static const int ReduceGuard = 2;
+
+	int reduceFactor(int src, int dst) {
+		int f = 1;
+		while (f < MaxReduceFactor && src >= 2 * f * ReduceGuard * dst)
+			f *= 2;
+		return f;
+	}
+
+	// Reduced pixel k averages the f source pixels from k * f - f / 2, so for the even
+	// factors its centre is half a source pixel before k * f.
+	int reducedSize(int size, int f) {
+		return (size - 1 + f / 2) / f + 1;
+	}
+
+	// The offset, in reduced pixels, that puts the filter's sampling positions back where
+	// they are without the reduction.
+	float reducedOffset(int f) {
+		return f > 1 ? 0.5f / f : 0.0f;
+	}
+
+	// Tables for resizing a source reduced by xreduce and yreduce to the destination.
+	template <typename Filter> void makeResizeTables(ResizeTables & tables, const Filter & filter,
+		int srcwidth, int srcheight, int dstwidth, int dstheight, int xreduce, int yreduce) {
 
 		// Scale and support values.
-		float xscale = src.width / float(dst.width);
-		float yscale = src.height / float(dst.height);
+		float xscale = srcwidth / float(dstwidth * xreduce);
+		float yscale = srcheight / float(dstheight * yreduce);
+		srcwidth = reducedSize(srcwidth, xreduce);
+		srcheight = reducedSize(srcheight, yreduce);
 		float xfscale = std::max(std::max(xscale, 1.0f), 1.0f / filter.support());
 		float yfscale = std::max(std::max(yscale, 1.0f), 1.0f / filter.support());
-		float xfsupport = filter.support() * xfscale;
-		float yfsupport = filter.support() * yfscale;
-		int maxxcontrib = int(std::ceil(2 * xfsupport));
-		int maxycontrib = int(std::ceil(2 * yfsupport));
-
-		// A temporary image to hold resized rows as we move through the image.
-		const int pixelChannels = PixelTraits<Pixel>::channels;
-		FloatBuffer tmp(dst.width, maxycontrib, pixelChannels);
+		int maxxcontrib = int(std::ceil(2 * filter.support() * xfscale));
+		int maxycontrib = int(std::ceil(2 * filter.support() * yfscale));
 
 		// Buffer to hold pre-calculated weights
-		PixelContribs contribs;
-		contribs.reserve(maxxcontrib * dst.width + maxycontrib * dst.height);
+		tables.contribs.reserve(maxxcontrib * dstwidth + maxycontrib * dstheight);
 
 		// Pre-computed source contributions for the rows.
-		RangeVector rowcontribs;
-		rowcontribs.resize(dst.width);
-		makeContribs(rowcontribs, filter, xscale, contribs, src.width);
+		tables.rowcopy = xreduce == 1 && srcwidth == dstwidth;
+		tables.rowcontribs.resize(dstwidth);
+		if (tables.rowcopy)
+			makeCopyContribs(tables.rowcontribs, tables.contribs);
+		else
+			makeContribs(tables.rowcontribs, filter, xscale, tables.contribs, srcwidth, reducedOffset(xreduce));
 
 		// Pre-computed source contributions for the columns.
-		RangeVector columncontribs;
-		columncontribs.resize(dst.height);
-		makeContribs(columncontribs, filter, yscale, contribs, src.height);
-
-		float centery = float(0.5) * yscale;
-		int srcrow(int(std::max(float(0), std::ceil(centery - yfsupport))));
-		for (int y = 0; y < dst.height; ++y, centery += yscale) {
-
-			// Resize any source rows needed for this row of the destination.
-			int needrow(std::min(src.height - 1, int(centery + yfsupport)));
-			while (srcrow <= needrow) {
-				float unpacked[pixelChannels];
-				char * srcdata = src.row(srcrow);
-				float * tmprow = tmp.row(srcrow % maxycontrib);
-				memset(tmprow, 0, sizeof(float) * pixelChannels * tmp.width);
-				for (int x = 0; x < tmp.width; ++x) {
-					for (int c = rowcontribs[x].left, w = rowcontribs[x].weights; c <= rowcontribs[x].right; ++c, ++w) {
-						PixelTraits<Pixel>::unpack(srcdata + c * PixelTraits<Pixel>::bytes, unpacked);
-						for (int p = 0; p < pixelChannels; ++p)
-							tmprow[p] += contribs[w] * unpacked[p];
+		tables.columncopy = yreduce == 1 && srcheight == dstheight;
+		tables.columncontribs.resize(dstheight);
+		if (tables.columncopy)
+			makeCopyContribs(tables.columncontribs, tables.contribs);
+		else
+			makeContribs(tables.columncontribs, filter, yscale, tables.contribs, srcheight, reducedOffset(yreduce));
+
+		// The ring of horizontally resized rows must hold the widest column range, which
+		// can be one more than the filter support when a range lands on whole rows.
+		tables.ringrows = 1;
+		for (RangeVector::iterator i = tables.columncontribs.begin(); i != tables.columncontribs.end(); ++i)
+			tables.ringrows = std::max(tables.ringrows, i->right - i->left + 1);
+
+		finishResizeTables(tables, srcwidth, srcheight);
+	}
+
+	// Destination images smaller than this many pixels per band are not worth splitting.
+	static const int MinBandPixels = 16 * 1024;
+
+	int resizeBands(const NativeImage & dst, int threads) {
+		int bands = int(std::min(int64_t(threads), int64_t(dst.width) * dst.height / MinBandPixels));
+		return std::max(1, std::min(bands, dst.height));
+	}
+
+	// The destination rows [y0, y1) of a band, and the first source row they need.
+	int bandRows(const RangeVector & columncontribs, int height, int band, int bands, int & y0, int & y1) {
+		y0 = int(int64_t(height) * band / bands);
+		y1 = int(int64_t(height) * (band + 1) / bands);
+		int srcrow = columncontribs[y0].left;
+		for (int y = y0 + 1; y < y1; ++y)
+			srcrow = std::min(srcrow, columncontribs[y].left);
+		return srcrow;
+	}
+
+	template <PixelMode Pixel> struct PixelRows {
+		static const bool deep = PixelTraits<Pixel>::bytes == 2 * PixelTraits<Pixel>::channels;
+
+		static void unpack(const char * src, float * dst, int count) {
+			if (deep) unpackRow16(reinterpret_cast<const uint16_t*>(src), dst, count);
+			else unpackRow8(reinterpret_cast<const uint8_t*>(src), dst, count);
+		}
+
+		static void pack(const float * src, char * dst, int count) {
+			if (deep) packRow16(src, reinterpret_cast<uint16_t*>(dst), count);
+			else packRow8(src, reinterpret_cast<uint8_t*>(dst), count);
+		}
+	};
+
+	template <PixelMode Pixel>
+	struct ResizeBands {
+		NativeImage & src;
+		NativeImage & dst;
+		const ResizeTables & tables;
+		const PaddedContribs<float> & rowweights;
+		int bands;
+
+		ResizeBands(NativeImage & s, NativeImage & d, const ResizeTables & t, const PaddedContribs<float> & rw, int b)
+			: src(s), dst(d), tables(t), rowweights(rw), bands(b) {}
+
+		// Resize the destination rows of a single band. Each band keeps its own ring of
+		// source rows, starting from the first source row the band needs.
+		void operator () (int band) {
+			const int pixelChannels = PixelTraits<Pixel>::channels;
+			const int srclength = src.width * pixelChannels;
+			const int dstlength = dst.width * pixelChannels;
+			int y0, y1;
+			int srcrow = bandRows(tables.columncontribs, dst.height, band, bands, y0, y1);
+
+			// Each source row is unpacked once, and each destination row is accumulated
+			// in floats before packing.
+			FloatBuffer unpacked(src.width, 1, pixelChannels);
+			FloatBuffer packing(dst.width, 1, pixelChannels);
+
+			// With the height unchanged each source row is filtered straight to its
+			// destination row.
+			if (tables.columncopy) {
+				for (int y = y0; y < y1; ++y) {
+					PixelRows<Pixel>::unpack(src.row(y), unpacked.row(0), srclength);
+					convolveRow(rowweights, unpacked.row(0), packing.row(0), dst.width, pixelChannels);
+					PixelRows<Pixel>::pack(packing.row(0), dst.row(y), dstlength);
+				}
+				return;
+			}
+
+			// A temporary image to hold source rows as we move through the image, resized
+			// to the destination width when the rows are filtered first.
+			const int ringrows = tables.ringrows;
+			FloatBuffer tmp(tables.rowsfirst ? dst.width : src.width, ringrows, pixelChannels);
+			FloatBuffer columns(src.width, 1, pixelChannels);
+			vector<const float*> rows(ringrows);
+
+			for (int y = y0; y < y1; ++y) {
+				const ContribRange & r = tables.columncontribs[y];
+
+				// Unpack, and resize, any source rows needed for this row of the destination.
+				for (; srcrow <= r.right; ++srcrow) {
+					if (tables.rowsfirst) {
+						PixelRows<Pixel>::unpack(src.row(srcrow), unpacked.row(0), srclength);
+						convolveRow(rowweights, unpacked.row(0), tmp.row(srcrow % ringrows), dst.width, pixelChannels);
+					}
+					else {
+						PixelRows<Pixel>::unpack(src.row(srcrow), tmp.row(srcrow % ringrows), srclength);
 					}
-					tmprow += pixelChannels;
 				}
-				++srcrow;
+
+				// Resize this row of the destination using the temporary rows.
+				for (int c = r.left; c <= r.right; ++c)
+					rows[c - r.left] = tmp.row(c % ringrows);
+				if (tables.rowsfirst || tables.rowcopy) {
+					convolveColumns(&rows[0], &tables.contribs[r.weights], r.right - r.left + 1, packing.row(0), dstlength);
+				}
+				else {
+					convolveColumns(&rows[0], &tables.contribs[r.weights], r.right - r.left + 1, columns.row(0), srclength);
+					convolveRow(rowweights, columns.row(0), packing.row(0), dst.width, pixelChannels);
+				}
+				PixelRows<Pixel>::pack(packing.row(0), dst.row(y), dstlength);
 			}
+		}
+	};
+
+	template <PixelMode Pixel>
+	void resizeImagePixel(NativeImage & src, NativeImage & dst, const ResizeTables & tables, int threads) {
+		assert(src.pixel == Pixel);
+		assert(dst.pixel == Pixel);
 
-			// Resize this row of the destination using the resized temporary rows.
-			char * dstrow = dst.row(y);
-			for (int x = 0; x < dst.width; ++x) {
-				float pixel[pixelChannels] = {};
-				for (int c = columncontribs[y].left, w = columncontribs[y].weights; c <= columncontribs[y].right; ++c, ++w) {
-					float * srcpixel = tmp.row(c % maxycontrib) + x * pixelChannels;
-					for (int p = 0; p < pixelChannels; ++p)
-						pixel[p] += contribs[w] * srcpixel[p];
+		// Split the destination into horizontal bands, one per thread.
+		int bands = resizeBands(dst, threads);
+		ResizeBands<Pixel> job(src, dst, tables, tables.rowweights, bands);
+		parallelFor(bands, bands, job);
+	}
+
+	// The fixed point engine for 8 bit pixels. The ring of horizontally resized rows holds
+	// 16 bit samples instead of floats, and the samples are never unpacked.
+	struct FixedResizeBands {
+		NativeImage & src;
+		NativeImage & dst;
+		const ResizeTables & tables;
+		const PaddedContribs<int16_t> & rowweights;
+		const vector<int16_t> & columnweights;
+		int channels;
+		int bands;
+
+		FixedResizeBands(NativeImage & s, NativeImage & d, const ResizeTables & t, const PaddedContribs<int16_t> & rw,
+			const vector<int16_t> & cw, int c, int b) : src(s), dst(d), tables(t), rowweights(rw), columnweights(cw),
+			channels(c), bands(b) {}
+
+		void operator () (int band) {
+			const int ringrows = tables.ringrows;
+			const int rowlength = dst.width * channels;
+			int y0, y1;
+			int srcrow = bandRows(tables.columncontribs, dst.height, band, bands, y0, y1);
+
+			// The kernels read and write a little past the ends of rows, so source rows are
+			// copied into a padded buffer and ring rows get spare samples.
+			const int srclength = src.width * channels;
+			const int stride = rowlength + FixedTapMultiple;
+			vector<uint8_t> padded(srclength + FixedRowSlack);
+			vector<int16_t> tmp(stride * ringrows);
+			vector<const int16_t*> rows(ringrows);
+
+			for (int y = y0; y < y1; ++y) {
+				const ContribRange & r = tables.columncontribs[y];
+
+				// With the width unchanged the source rows only need widening to ring samples.
+				for (; srcrow <= r.right; ++srcrow) {
+					int16_t * row = &tmp[(srcrow % ringrows) * stride];
+					if (tables.rowcopy) {
+						const uint8_t * s = reinterpret_cast<const uint8_t*>(src.row(srcrow));
+						for (int i = 0; i < srclength; ++i)
+							row[i] = int16_t(s[i] << FixedRowBits);
+					}
+					else {
+						memcpy(&padded[0], src.row(srcrow), srclength);
+						convolveRowFixed(rowweights, &padded[0], row, dst.width, channels);
+					}
 				}
-				PixelTraits<Pixel>::pack(pixel, dstrow);
-				dstrow += PixelTraits<Pixel>::bytes;
+
+				for (int c = r.left; c <= r.right; ++c)
+					rows[c - r.left] = &tmp[(c % ringrows) * stride];
+				convolveColumnsFixed(&rows[0], &columnweights[r.weights], r.right - r.left + 1,
+					reinterpret_cast<uint8_t*>(dst.row(y)), rowlength);
 			}
 		}
+	};
+
+	void resizeImageFixed(NativeImage & src, NativeImage & dst, const ResizeTables & tables, int threads) {
+		assert(src.pixel == dst.pixel);
+		int channels = pixelChannels(src.pixel);
+		assert(pixelBytes(src.pixel) == channels);
+
+		int bands = resizeBands(dst, threads);
+		FixedResizeBands job(src, dst, tables, tables.fixedrowweights, tables.fixedcolumnweights, channels, bands);
+		parallelFor(bands, bands, job);
 	}
 
-	template <typename Filter> void resizeImage(NativeImage& src, NativeImage& dst, const Filter& filter) {
+	void resizeImage(const ResizeOptions & opts, const ResizeTables & tables, NativeImage& src, NativeImage& dst) {
 		assert(src.pixel == dst.pixel);
+		if (tables.rowcopy && tables.columncopy) {
+			for (int y = 0; y < dst.height; ++y)
+				memcpy(dst.row(y), src.row(y), dst.width * pixelBytes(dst.pixel));
+			return;
+		}
+
+		switch (src.pixel) {
+			case RGBA_PIXEL :
+			case RGB_PIXEL :
+			case GREY_PIXEL :
+			case GREYA_PIXEL :
+				if (opts.fixed) {
+					resizeImageFixed(src, dst, tables, opts.threads);
+					return;
+				}
+				break;
+			default :
+				break;
+		}
+
 		switch (src.pixel) {
-			case RGBA_PIXEL : resizeImagePixel<RGBA_PIXEL>(src, dst, filter); break;
-			case RGB_PIXEL : resizeImagePixel<RGB_PIXEL>(src, dst, filter); break;
-			case GREY_PIXEL : resizeImagePixel<GREY_PIXEL>(src, dst, filter); break;
-			case GREYA_PIXEL : resizeImagePixel<GREYA_PIXEL>(src, dst, filter); break;
-			case R16_PIXEL : resizeImagePixel<R16_PIXEL>(src, dst, filter); break;
-			case R16G16_PIXEL : resizeImagePixel<R16G16_PIXEL>(src, dst, filter); break;
-			case R16G16B16_PIXEL : resizeImagePixel<R16G16B16_PIXEL>(src, dst, filter); break;
-			case R16G16B16A16_PIXEL : resizeImagePixel<R16G16B16A16_PIXEL>(src, dst, filter); break;
+			case RGBA_PIXEL : resizeImagePixel<RGBA_PIXEL>(src, dst, tables, opts.threads); break;
+			case RGB_PIXEL : resizeImagePixel<RGB_PIXEL>(src, dst, tables, opts.threads); break;
+			case GREY_PIXEL : resizeImagePixel<GREY_PIXEL>(src, dst, tables, opts.threads); break;
+			case GREYA_PIXEL : resizeImagePixel<GREYA_PIXEL>(src, dst, tables, opts.threads); break;
+			case R16_PIXEL : resizeImagePixel<R16_PIXEL>(src, dst, tables, opts.threads); break;
+			case R16G16_PIXEL : resizeImagePixel<R16G16_PIXEL>(src, dst, tables, opts.threads); break;
+			case R16G16B16_PIXEL : resizeImagePixel<R16G16B16_PIXEL>(src, dst, tables, opts.threads); break;
+			case R16G16B16A16_PIXEL : resizeImagePixel<R16G16B16A16_PIXEL>(src, dst, tables, opts.threads); break;
 			default : assert(false);
 		}
 	}
 
-	enum ResizeFilterTag {
-		CubicFilterTag,
-		LanczosFilterTag,
-		CatmulRomFilterTag,
-		MitchelFilterTag,
-		BoxFilterTag,
-		TriangleFilterTag,
-
-		InvalidFilterTag,
-	};
-
 	static Persistent<String>* const resizeFilterSymbols[] = {
 		&cubic_symbol, &lanczos_symbol, &catmulrom_symbol, &mitchel_symbol, &box_symbol, &triangle_symbol
 	};
@@ -170,12 +470,6 @@ namespace picha {
 		return InvalidFilterTag;
 	}
 
-	struct ResizeOptions {
-		ResizeOptions() : filter(CubicFilterTag), width(0.70f) {}
-		ResizeFilterTag filter;
-		float width;
-	};
-
 	bool getResizeOptions(ResizeOptions& s, Local<Object> opts) {
 		Local<Value> v = opts->Get(Nan::GetCurrentContext(), Nan::New(filter_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
 		if (!v->IsUndefined()) {
@@ -194,6 +488,28 @@ namespace picha {
 				return false;
 			}
 		}
+		v = opts->Get(Nan::GetCurrentContext(), Nan::New(threads_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			double threads = v->NumberValue(Nan::GetCurrentContext()).FromMaybe(0);
+			if (threads != threads || threads < 1) {
+				Nan::ThrowError("invalid thread count");
+				return false;
+			}
+			s.threads = int(std::min(threads, 256.0));
+		}
+		v = opts->Get(Nan::GetCurrentContext(), Nan::New(reduce_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		s.reduce = v->ToBoolean(v8::Isolate::GetCurrent())->Value();
+		v = opts->Get(Nan::GetCurrentContext(), Nan::New(precision_symbol)).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsUndefined()) {
+			if (v->StrictEquals(Nan::New(fast_symbol)))
+				s.fixed = true;
+			else if (v->StrictEquals(Nan::New(accurate_symbol)))
+				s.fixed = false;
+			else {
+				Nan::ThrowError("invalid precision");
+				return false;
+			}
+		}
 		return true;
 	}
 
@@ -267,16 +583,184 @@ namespace picha {
 		float operator () (float f) const { return filter(f / scale) / scale; }
 	};
 
-	void resizeImage(const ResizeOptions& opts, NativeImage& src, NativeImage& dst) {
+	struct ResizeTablesKey {
+		ResizeFilterTag filter;
+		float width;
+		int srcwidth, srcheight, dstwidth, dstheight;
+		int xreduce, yreduce;
+
+		bool operator < (const ResizeTablesKey & o) const {
+			if (filter != o.filter) return filter < o.filter;
+			if (width != o.width) return width < o.width;
+			if (srcwidth != o.srcwidth) return srcwidth < o.srcwidth;
+			if (srcheight != o.srcheight) return srcheight < o.srcheight;
+			if (dstwidth != o.dstwidth) return dstwidth < o.dstwidth;
+			if (dstheight != o.dstheight) return dstheight < o.dstheight;
+			if (xreduce != o.xreduce) return xreduce < o.xreduce;
+			return yreduce < o.yreduce;
+		}
+	};
+
+	typedef std::shared_ptr<const ResizeTables> ResizeTablesPtr;
+
+	// A process wide, least recently used cache of resize tables, so images sharing a
+	// filter and sizes only pay for the filter weights once. Entries are shared with the
+	// resizes using them, so eviction never frees tables still in use.
+	class ResizeTablesCache {
+	public:
+		ResizeTablesCache(size_t c) : capacity(c), hits(0), misses(0) { uv_mutex_init(&lock); }
+
+		ResizeTablesPtr find(const ResizeTablesKey & key) {
+			uv_mutex_lock(&lock);
+			ResizeTablesPtr r;
+			EntryMap::iterator i = entries.find(key);
+			if (i != entries.end()) {
+				order.splice(order.begin(), order, i->second);
+				r = i->second->second;
+				hits += 1;
+			}
+			else {
+				misses += 1;
+			}
+			uv_mutex_unlock(&lock);
+			return r;
+		}
+
+		void insert(const ResizeTablesKey & key, const ResizeTablesPtr & tables) {
+			uv_mutex_lock(&lock);
+			if (entries.find(key) == entries.end()) {
+				order.push_front(Entry(key, tables));
+				entries[key] = order.begin();
+				while (order.size() > capacity) {
+					entries.erase(order.back().first);
+					order.pop_back();
+				}
+			}
+			uv_mutex_unlock(&lock);
+		}
+
+		void stats(size_t & h, size_t & m, size_t & n, size_t & c) {
+			uv_mutex_lock(&lock);
+			h = hits;
+			m = misses;
+			n = order.size();
+			c = capacity;
+			uv_mutex_unlock(&lock);
+		}
+
+	private:
+		typedef std::pair<ResizeTablesKey, ResizeTablesPtr> Entry;
+		typedef std::list<Entry> EntryList;
+		typedef std::map<ResizeTablesKey, EntryList::iterator> EntryMap;
+
+		uv_mutex_t lock;
+		size_t capacity;
+		size_t hits, misses;
+		EntryList order;
+		EntryMap entries;
+	};
+
+	static const size_t ResizeTablesCacheSize = 32;
+
+	ResizeTablesCache& resizeTablesCache() {
+		static ResizeTablesCache cache(ResizeTablesCacheSize);
+		return cache;
+	}
+
+	ResizeTablesPtr getResizeTables(const ResizeOptions& opts, int sw, int sh, int dw, int dh, int fx, int fy) {
+		ResizeTablesKey key = { opts.filter, opts.width, sw, sh, dw, dh, fx, fy };
+		ResizeTablesPtr cached = resizeTablesCache().find(key);
+		if (cached)
+			return cached;
+
+		// Tables are built outside the lock; two threads missing on the same key at once
+		// both build them and the first insert wins.
+		std::shared_ptr<ResizeTables> tables = std::make_shared<ResizeTables>();
 		switch (opts.filter) {
-			case CubicFilterTag : resizeImage(src, dst, ScaledFilter<CubicFilter>(opts.width)); break;
-			case LanczosFilterTag : resizeImage(src, dst, ScaledFilter<LanczosFilter>(opts.width)); break;
-			case CatmulRomFilterTag : resizeImage(src, dst, ScaledFilter<CatmulRomFilter>(opts.width)); break;
-			case MitchelFilterTag : resizeImage(src, dst, ScaledFilter<MitchelFilter>(opts.width)); break;
-			case BoxFilterTag : resizeImage(src, dst, ScaledFilter<BoxFilter>(opts.width)); break;
-			case TriangleFilterTag : resizeImage(src, dst, ScaledFilter<TriangleFilter>(opts.width)); break;
+			case CubicFilterTag : makeResizeTables(*tables, ScaledFilter<CubicFilter>(opts.width), sw, sh, dw, dh, fx, fy); break;
+			case LanczosFilterTag : makeResizeTables(*tables, ScaledFilter<LanczosFilter>(opts.width), sw, sh, dw, dh, fx, fy); break;
+			case CatmulRomFilterTag : makeResizeTables(*tables, ScaledFilter<CatmulRomFilter>(opts.width), sw, sh, dw, dh, fx, fy); break;
+			case MitchelFilterTag : makeResizeTables(*tables, ScaledFilter<MitchelFilter>(opts.width), sw, sh, dw, dh, fx, fy); break;
+			case BoxFilterTag : makeResizeTables(*tables, ScaledFilter<BoxFilter>(opts.width), sw, sh, dw, dh, fx, fy); break;
+			case TriangleFilterTag : makeResizeTables(*tables, ScaledFilter<TriangleFilter>(opts.width), sw, sh, dw, dh, fx, fy); break;
 			default: assert(false);
 		}
+		resizeTablesCache().insert(key, tables);
+		return tables;
+	}
+
+	// Sums of up to MaxReduceFactor 8 bit rows fit 16 bit accumulators, which halves the
+	// width of the vectorized row sums.
+	template <typename T, typename Sum> struct ReduceBands {
+		NativeImage & src;
+		NativeImage & dst;
+		int fx, fy, channels, bands;
+
+		ReduceBands(NativeImage & s, NativeImage & d, int x, int y, int c, int b)
+			: src(s), dst(d), fx(x), fy(y), channels(c), bands(b) {}
+
+		// Each destination row sums its block of source rows in one pass over the row,
+		// then averages groups of columns. Blocks cut short by the edges average the
+		// pixels they have.
+		void operator () (int band) {
+			int y0 = int(int64_t(dst.height) * band / bands);
+			int y1 = int(int64_t(dst.height) * (band + 1) / bands);
+			const int srclength = src.width * channels;
+			vector<Sum> sums(srclength);
+
+			for (int y = y0; y < y1; ++y) {
+				int top = std::max(0, y * fy - fy / 2), bottom = std::min(src.height, y * fy - fy / 2 + fy);
+				std::fill(sums.begin(), sums.end(), 0);
+				for (int sy = top; sy < bottom; ++sy) {
+					const T * s = reinterpret_cast<const T*>(src.row(sy));
+					for (int i = 0; i < srclength; ++i)
+						sums[i] += s[i];
+				}
+
+				T * d = reinterpret_cast<T*>(dst.row(y));
+				for (int x = 0; x < dst.width; ++x) {
+					int left = std::max(0, x * fx - fx / 2), right = std::min(src.width, x * fx - fx / 2 + fx);
+					uint32_t n = (right - left) * (bottom - top);
+					for (int c = 0; c < channels; ++c) {
+						uint32_t sum = 0;
+						for (int sx = left; sx < right; ++sx)
+							sum += sums[sx * channels + c];
+						d[x * channels + c] = T((sum + n / 2) / n);
+					}
+				}
+			}
+		}
+	};
+
+	void reduceImage(NativeImage & src, NativeImage & dst, int fx, int fy, int threads) {
+		int channels = pixelChannels(src.pixel);
+		int bands = resizeBands(dst, threads);
+		if (pixelBytes(src.pixel) == channels) {
+			ReduceBands<uint8_t, uint16_t> job(src, dst, fx, fy, channels, bands);
+			parallelFor(bands, bands, job);
+		}
+		else {
+			ReduceBands<uint16_t, uint32_t> job(src, dst, fx, fy, channels, bands);
+			parallelFor(bands, bands, job);
+		}
+	}
+
+	void resizeImage(const ResizeOptions& opts, NativeImage& src, NativeImage& dst) {
+		if (opts.reduce) {
+			int fx = reduceFactor(src.width, dst.width);
+			int fy = reduceFactor(src.height, dst.height);
+			if (fx > 1 || fy > 1) {
+				NativeImage reduced = newNativeImage(reducedSize(src.width, fx), reducedSize(src.height, fy), src.pixel);
+				reduceImage(src, reduced, fx, fy, opts.threads);
+				ResizeTablesPtr tables = getResizeTables(opts, src.width, src.height, dst.width, dst.height, fx, fy);
+				resizeImage(opts, *tables, reduced, dst);
+				freeNativeImage(reduced);
+				return;
+			}
+		}
+
+		ResizeTablesPtr tables = getResizeTables(opts, src.width, src.height, dst.width, dst.height, 1, 1);
+		resizeImage(opts, *tables, src, dst);
 	}
 
 	struct ResizeContext {
@@ -402,4 +886,16 @@ namespace picha {
 		return;
 	}
 
+	NAN_METHOD(resizeCacheStats) {
+		size_t hits, misses, entries, capacity;
+		resizeTablesCache().stats(hits, misses, entries, capacity);
+
+		Local<Object> r = Nan::New<Object>();
+		Nan::Set(r, Nan::New(hits_symbol), Nan::New<Number>(double(hits)));
+		Nan::Set(r, Nan::New(misses_symbol), Nan::New<Number>(double(misses)));
+		Nan::Set(r, Nan::New(entries_symbol), Nan::New<Number>(double(entries)));
+		Nan::Set(r, Nan::New(capacity_symbol), Nan::New<Number>(double(capacity)));
+		info.GetReturnValue().Set(r);
+	}
+
 }
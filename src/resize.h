@@ -7,6 +7,7 @@ namespace picha {
 
 	NAN_METHOD(resize);
 	NAN_METHOD(resizeSync);
+	NAN_METHOD(resizeCacheStats);
 }
 
 #endif // picha_resize_h_
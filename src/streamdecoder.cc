@@ -0,0 +1,280 @@
+#include <node_buffer.h>
+
+#include "streamdecoder.h"
+
+#ifdef WITH_PNG
+#include "pngcodec.h"
+#endif
+
+#ifdef WITH_JPEG
+#include "jpegcodec.h"
+#endif
+
+#ifdef WITH_WEBP
+#include "webpcodec.h"
+#endif
+
+namespace picha {
+
+	//----------------------------------------------------------------------------------------------------------------
+	//--
+
+	// The js object holding a StreamDecoder. One push or end runs at a time, on a libuv
+	// thread or the v8 thread, and the object stays alive while one is in flight.
+	class DecoderObject : public Nan::ObjectWrap {
+	public:
+		StreamDecoder * decoder;
+		bool busy;
+		bool ended;
+
+		// The decoder's vitals and progress as of the last push to finish, for stat to
+		// read while the next one may be decoding on a libuv thread.
+		int width, height, rows;
+		PixelMode pixel;
+
+		DecoderObject() : decoder(0), busy(false), ended(false), width(0), height(0), rows(0), pixel(INVALID_PIXEL) {}
+		~DecoderObject() { delete decoder; }
+
+		static Nan::Persistent<Function> constructor;
+
+		static NAN_METHOD(New) {
+			DecoderObject * self = new DecoderObject;
+			self->Wrap(info.This());
+			info.GetReturnValue().Set(info.This());
+		}
+
+		static NAN_METHOD(push);
+		static NAN_METHOD(pushSync);
+		static NAN_METHOD(end);
+		static NAN_METHOD(endSync);
+		static NAN_METHOD(stat);
+
+		// Check the object can take another push or end, throwing if not.
+		bool ready();
+
+		// Copy the decoder's progress for stat, once a push is done with it.
+		void snapshot();
+
+		// The decoded image, whose pixels the decoder hands over.
+		Local<Value> result();
+
+		void ref() { Ref(); }
+		void unref() { Unref(); }
+	};
+
+	Nan::Persistent<Function> DecoderObject::constructor;
+
+	bool DecoderObject::ready() {
+		if (busy) {
+			Nan::ThrowError("decoder busy");
+			return false;
+		}
+		if (ended) {
+			Nan::ThrowError("decoder ended");
+			return false;
+		}
+		return true;
+	}
+
+	void DecoderObject::snapshot() {
+		width = decoder->image.width;
+		height = decoder->image.height;
+		pixel = decoder->image.pixel;
+		rows = decoder->rows;
+	}
+
+	Local<Value> DecoderObject::result() {
+		NativeImage & image = decoder->image;
+		Local<Object> jsimage = Nan::New<Object>();
+		Nan::Set(jsimage, Nan::New(width_symbol), Nan::New<Integer>(image.width));
+		Nan::Set(jsimage, Nan::New(height_symbol), Nan::New<Integer>(image.height));
+		Nan::Set(jsimage, Nan::New(stride_symbol), Nan::New<Integer>(image.stride));
+		Nan::Set(jsimage, Nan::New(pixel_symbol), pixelEnumToSymbol(image.pixel));
+
+		size_t datalen = size_t(image.height) * image.stride;
+		Local<Value> jspixel;
+		if (Nan::NewBuffer(decoder->release(), datalen).ToLocal(&jspixel))
+			Nan::Set(jsimage, Nan::New(data_symbol), jspixel);
+		return jsimage;
+	}
+
+	struct StreamDecodeCtx {
+		Nan::Persistent<Object> buffer;
+		Nan::Persistent<Function> cb;
+		DecoderObject * self;
+		const char * data;
+		size_t len;
+		bool end;
+	};
+
+	void UV_streamDecode(uv_work_t* work_req) {
+		StreamDecodeCtx *ctx = reinterpret_cast<StreamDecodeCtx*>(work_req->data);
+		StreamDecoder * decoder = ctx->self->decoder;
+		if (!decoder->error && ctx->len > 0)
+			decoder->push(ctx->data, ctx->len);
+		if (ctx->end)
+			decoder->end();
+	}
+
+	void V8_streamDecode(uv_work_t* work_req, int) {
+		Nan::HandleScope scope;
+		StreamDecodeCtx *ctx = reinterpret_cast<StreamDecodeCtx*>(work_req->data);
+		DecoderObject * self = ctx->self;
+		self->busy = false;
+		self->snapshot();
+		const char * error = self->decoder->error;
+		Local<Value> r = ctx->end && !error ? self->result() : Local<Value>(Nan::Undefined());
+		makeCallback(Nan::New(ctx->cb), error, r);
+		self->unref();
+		ctx->buffer.Reset();
+		ctx->cb.Reset();
+		delete work_req;
+		delete ctx;
+	}
+
+	void queueStreamDecode(DecoderObject * self, Local<Object> buffer, Local<Function> cb, bool end) {
+		StreamDecodeCtx * ctx = new StreamDecodeCtx;
+		ctx->self = self;
+		ctx->end = end;
+		ctx->data = buffer.IsEmpty() ? 0 : Buffer::Data(buffer);
+		ctx->len = buffer.IsEmpty() ? 0 : Buffer::Length(buffer);
+		if (!buffer.IsEmpty())
+			ctx->buffer.Reset(buffer);
+		ctx->cb.Reset(cb);
+		self->busy = true;
+		self->ended = end;
+		self->ref();
+
+		uv_work_t* work_req = new uv_work_t();
+		work_req->data = ctx;
+		uv_queue_work(uv_default_loop(), work_req, UV_streamDecode, V8_streamDecode);
+	}
+
+	NAN_METHOD(DecoderObject::push) {
+		if (info.Length() != 2 || !Buffer::HasInstance(info[0]) || !info[1]->IsFunction()) {
+			Nan::ThrowError("expected: push(buffer, cb)");
+			return;
+		}
+		DecoderObject * self = Nan::ObjectWrap::Unwrap<DecoderObject>(info.This());
+		MaybeLocal<Object> mbuf = info[0]->ToObject(Nan::GetCurrentContext());
+		if (mbuf.IsEmpty() || !self->ready())
+			return;
+		queueStreamDecode(self, mbuf.ToLocalChecked(), Local<Function>::Cast(info[1]), false);
+	}
+
+	NAN_METHOD(DecoderObject::end) {
+		if (info.Length() != 1 || !info[0]->IsFunction()) {
+			Nan::ThrowError("expected: end(cb)");
+			return;
+		}
+		DecoderObject * self = Nan::ObjectWrap::Unwrap<DecoderObject>(info.This());
+		if (!self->ready())
+			return;
+		queueStreamDecode(self, Local<Object>(), Local<Function>::Cast(info[0]), true);
+	}
+
+	NAN_METHOD(DecoderObject::pushSync) {
+		if (info.Length() != 1 || !Buffer::HasInstance(info[0])) {
+			Nan::ThrowError("expected: pushSync(buffer)");
+			return;
+		}
+		DecoderObject * self = Nan::ObjectWrap::Unwrap<DecoderObject>(info.This());
+		MaybeLocal<Object> mbuf = info[0]->ToObject(Nan::GetCurrentContext());
+		if (mbuf.IsEmpty() || !self->ready())
+			return;
+		Local<Object> buf = mbuf.ToLocalChecked();
+		StreamDecoder * decoder = self->decoder;
+		if (!decoder->error && Buffer::Length(buf) > 0)
+			decoder->push(Buffer::Data(buf), Buffer::Length(buf));
+		self->snapshot();
+		if (decoder->error)
+			Nan::ThrowError(decoder->error);
+	}
+
+	NAN_METHOD(DecoderObject::endSync) {
+		DecoderObject * self = Nan::ObjectWrap::Unwrap<DecoderObject>(info.This());
+		if (!self->ready())
+			return;
+		self->ended = true;
+		self->decoder->end();
+		self->snapshot();
+		if (self->decoder->error) {
+			Nan::ThrowError(self->decoder->error);
+			return;
+		}
+		info.GetReturnValue().Set(self->result());
+	}
+
+	// The image's vitals and progress once the header has been read, or undefined.
+	NAN_METHOD(DecoderObject::stat) {
+		DecoderObject * self = Nan::ObjectWrap::Unwrap<DecoderObject>(info.This());
+		if (self->pixel == INVALID_PIXEL)
+			return;
+
+		Local<Object> stat = Nan::New<Object>();
+		Nan::Set(stat, Nan::New(width_symbol), Nan::New<Integer>(self->width));
+		Nan::Set(stat, Nan::New(height_symbol), Nan::New<Integer>(self->height));
+		Nan::Set(stat, Nan::New(pixel_symbol), pixelEnumToSymbol(self->pixel));
+		Nan::Set(stat, Nan::New(rows_symbol), Nan::New<Integer>(self->rows));
+		info.GetReturnValue().Set(stat);
+	}
+
+	void initStreamDecoder() {
+		Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(DecoderObject::New);
+		tpl->SetClassName(Nan::New("Decoder").ToLocalChecked());
+		tpl->InstanceTemplate()->SetInternalFieldCount(1);
+		Nan::SetPrototypeMethod(tpl, "push", DecoderObject::push);
+		Nan::SetPrototypeMethod(tpl, "pushSync", DecoderObject::pushSync);
+		Nan::SetPrototypeMethod(tpl, "end", DecoderObject::end);
+		Nan::SetPrototypeMethod(tpl, "endSync", DecoderObject::endSync);
+		Nan::SetPrototypeMethod(tpl, "stat", DecoderObject::stat);
+		DecoderObject::constructor.Reset(Nan::GetFunction(tpl).ToLocalChecked());
+	}
+
+	NAN_METHOD(createDecoder) {
+		if (info.Length() != 2 || !info[0]->IsString() || !info[1]->IsObject()) {
+			Nan::ThrowError("expected: createDecoder(mimetype, opts)");
+			return;
+		}
+		MaybeLocal<Object> mopts = info[1]->ToObject(Nan::GetCurrentContext());
+		if (mopts.IsEmpty())
+			return;
+		Local<Object> opts = mopts.ToLocalChecked();
+
+		StreamDecoder * decoder = 0;
+		bool known = false;
+#ifdef WITH_PNG
+		if (info[0]->StrictEquals(Nan::New("image/png").ToLocalChecked())) {
+			known = true;
+			decoder = newPngStreamDecoder(opts);
+		}
+#endif
+#ifdef WITH_JPEG
+		if (info[0]->StrictEquals(Nan::New("image/jpeg").ToLocalChecked())) {
+			known = true;
+			decoder = newJpegStreamDecoder(opts);
+		}
+#endif
+#ifdef WITH_WEBP
+		if (info[0]->StrictEquals(Nan::New("image/webp").ToLocalChecked())) {
+			known = true;
+			decoder = newWebPStreamDecoder(opts);
+		}
+#endif
+		if (!known) {
+			Nan::ThrowError("no streaming decoder for the mimetype");
+			return;
+		}
+		if (decoder == 0)
+			return;
+
+		Local<Object> obj;
+		if (!Nan::NewInstance(Nan::New(DecoderObject::constructor)).ToLocal(&obj)) {
+			delete decoder;
+			return;
+		}
+		Nan::ObjectWrap::Unwrap<DecoderObject>(obj)->decoder = decoder;
+		info.GetReturnValue().Set(obj);
+	}
+
+}
@@ -0,0 +1,63 @@
+#ifndef picha_streamdecoder_h_
+#define picha_streamdecoder_h_
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "picha.h"
+
+namespace picha {
+
+	//----------------------------------------------------------------------------------------------------------------
+	//--
+
+	// A decoder fed an image's bytes a chunk at a time, which decodes as far as the bytes
+	// so far allow. The pixels are malloc'd once the header is read, so they can pass to a
+	// js buffer without a copy.
+	struct StreamDecoder {
+		NativeImage image;
+
+		// The rows of the image decoded so far.
+		int rows;
+
+		char * error;
+
+		StreamDecoder() : rows(0), error(0) {}
+
+		virtual ~StreamDecoder() {
+			free(image.data);
+			if (error)
+				free(error);
+		}
+
+		// Decode what the next chunk of bytes allows.
+		virtual void push(const char * data, size_t len) = 0;
+
+		// There are no more bytes. An image that hasn't been decoded by now fails.
+		void end() {
+			if (!error && (image.data == 0 || rows < image.height))
+				error = strdup("unexpected end of image data");
+		}
+
+		void allocate(int width, int height, PixelMode pixel) {
+			image.width = width;
+			image.height = height;
+			image.pixel = pixel;
+			image.stride = NativeImage::row_stride(width, pixel);
+			image.data = (char*)malloc(size_t(height) * image.stride);
+		}
+
+		// Hand the pixels over to the caller.
+		char * release() {
+			char * data = image.data;
+			image.data = 0;
+			return data;
+		}
+	};
+
+	NAN_METHOD(createDecoder);
+	void initStreamDecoder();
+
+}
+
+#endif // picha_streamdecoder_h_
@@ -296,8 +296,7 @@ namespace picha {
 
 	tmsize_t TiffWriter::writeProc(thandle_t h, void* buf, tmsize_t size) {
 		TiffWriter * w = reinterpret_cast<TiffWriter*>(h);
-		w->buffer.write(reinterpret_cast<char*>(buf), size);
-		return size;
+		return w->buffer.write(reinterpret_cast<char*>(buf), size) ? size : 0;
 	}
 
 	uint64_t TiffWriter::seekProc(thandle_t h, uint64_t off, int whence) {
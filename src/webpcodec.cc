@@ -1,5 +1,6 @@
 
 #include <stdlib.h>
+#include <vector>
 
 #include <webp/decode.h>
 #include <webp/encode.h>
@@ -8,6 +9,7 @@
 #include <node_buffer.h>
 
 #include "webpcodec.h"
+#include "streamdecoder.h"
 
 namespace picha {
 
@@ -137,6 +139,60 @@ namespace picha {
 		info.GetReturnValue().Set(stat);
 	}
 
+	// Holds the bytes until the header is complete, then decodes into the image through an
+	// incremental decoder, which keeps its own copy of the data it still needs.
+	struct WebPStreamDecoder : public StreamDecoder {
+		std::vector<uint8_t> head;
+		WebPIDecoder * idec;
+
+		WebPStreamDecoder() : idec(0) {}
+		~WebPStreamDecoder() { if (idec) WebPIDelete(idec); }
+
+		void push(const char * data, size_t len) {
+			const uint8_t * bytes = (const uint8_t*)data;
+			if (len == 0)
+				return;
+			if (idec == 0) {
+				head.insert(head.end(), bytes, bytes + len);
+				WebPBitstreamFeatures feat;
+				VP8StatusCode status = WebPGetFeatures(&head[0], head.size(), &feat);
+				if (status == VP8_STATUS_NOT_ENOUGH_DATA)
+					return;
+				if (status != VP8_STATUS_OK) {
+					error = strdup("invalid image features");
+					return;
+				}
+
+				allocate(feat.width, feat.height, feat.has_alpha ? RGBA_PIXEL : RGB_PIXEL);
+				idec = WebPINewRGB(feat.has_alpha ? MODE_RGBA : MODE_RGB, reinterpret_cast<uint8_t*>(image.data), image.stride * image.height, image.stride);
+				if (image.data == 0 || idec == 0) {
+					error = strdup("failed to initialize webp decoder");
+					return;
+				}
+				append(&head[0], head.size());
+				std::vector<uint8_t>().swap(head);
+			}
+			else {
+				append(bytes, len);
+			}
+		}
+
+		void append(const uint8_t * data, size_t len) {
+			VP8StatusCode status = WebPIAppend(idec, data, len);
+			if (status != VP8_STATUS_OK && status != VP8_STATUS_SUSPENDED) {
+				error = strdup("error decoding image");
+				return;
+			}
+			int y = 0;
+			if (WebPIDecGetRGB(idec, &y, 0, 0, 0))
+				rows = status == VP8_STATUS_OK ? image.height : y;
+		}
+	};
+
+	StreamDecoder * newWebPStreamDecoder(Local<Object> opts) {
+		return new WebPStreamDecoder;
+	}
+
 	//---------------------------------------------------------------------------------------------------------
 
 	namespace {
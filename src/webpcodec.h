@@ -5,12 +5,15 @@
 
 namespace picha {
 
+	struct StreamDecoder;
+
 	NAN_METHOD(statWebP);
 	NAN_METHOD(decodeWebP);
 	NAN_METHOD(decodeWebPSync);
 	NAN_METHOD(encodeWebP);
 	NAN_METHOD(encodeWebPSync);
 	std::vector<PixelMode> getWebpEncodes();
+	StreamDecoder * newWebPStreamDecoder(Local<Object> opts);
 
 }
 
@@ -7,21 +7,16 @@ namespace picha {
 
 	//---------------------------------------------------------------------------------------------------------
 
-	void WriteBuffer::write(char * data, size_t length) {
+	bool WriteBuffer::write(char * data, size_t length) {
 		while (length > 0) {
 			size_t space = cblock == 0 ? 0 : cblock->length + cblock->start - cursor;
 			if (space == 0) {
 				if (cblock == 0 || cblock->next == 0) {
-					WriteBlock * n = new WriteBlock;
-					n->length = length > min_block ? length : min_block;
-					n->data = reinterpret_cast<char*>(malloc(n->length));
-					n->start = cursor;
-					if (cblock == 0) cblock = hblock = n;
-					else cblock = cblock->next = n;
+					if (!append_(length))
+						return false;
 				}
-				else {
+				else
 					cblock = cblock->next;
-				}
 			}
 			else {
 				size_t l = length < space ? length : space;
@@ -33,6 +28,51 @@ namespace picha {
 		}
 		if (totallen < cursor)
 			totallen = cursor;
+		return true;
+	}
+
+	char * WriteBuffer::next_(size_t length, size_t & space) {
+		space = cblock == 0 ? 0 : cblock->length + cblock->start - cursor;
+		while (space == 0) {
+			if (cblock == 0 || cblock->next == 0) {
+				if (!append_(length))
+					return 0;
+			}
+			else
+				cblock = cblock->next;
+			space = cblock->length + cblock->start - cursor;
+		}
+		return cblock->data + cblock->length - space;
+	}
+
+	bool WriteBuffer::append_(size_t length) {
+		WriteBlock * n = new WriteBlock;
+		n->length = length > min_block ? length : min_block;
+		n->data = reinterpret_cast<char*>(malloc(n->length));
+		if (n->data == 0) {
+			delete n;
+			return false;
+		}
+		n->start = cursor;
+		if (cblock == 0) {
+			cblock = hblock = n;
+		}
+		else if (sink) {
+			sink->block(cblock->data, cblock->length);
+			cblock->data = 0;
+			delete cblock;
+			cblock = hblock = n;
+		}
+		else {
+			cblock = cblock->next = n;
+		}
+		return true;
+	}
+
+	void WriteBuffer::advance_(size_t length) {
+		cursor += length;
+		if (totallen < cursor)
+			totallen = cursor;
 	}
 
 	void WriteBuffer::seek_(size_t length) {
@@ -84,10 +124,16 @@ namespace picha {
 			if (hblock->next == 0) {
 				r = hblock->data;
 				hblock->data = 0;
+				// Hand back the unused tail of a generous first block.
+				if (totallen > 0 && hblock->length > totallen + min_block) {
+					char * t = reinterpret_cast<char*>(realloc(r, totallen));
+					if (t != 0)
+						r = t;
+				}
 			}
 			else {
 				r = reinterpret_cast<char*>(malloc(totallen));
-				for (WriteBlock * b = hblock; b != 0; b = b->next) {
+				for (WriteBlock * b = hblock; r != 0 && b != 0; b = b->next) {
 					size_t l = b->length > totallen - b->start ? totallen - b->start : b->length;
 					memcpy(r + b->start, b->data, l);
 				}
@@ -101,4 +147,106 @@ namespace picha {
 		return r;
 	}
 
+	void WriteBuffer::flush_() {
+		if (hblock != 0 && cursor > hblock->start) {
+			sink->block(hblock->data, cursor - hblock->start);
+			hblock->data = 0;
+		}
+		delete hblock;
+		hblock = 0;
+		cblock = 0;
+	}
+
+	//---------------------------------------------------------------------------------------------------------
+
+	ChunkStream::ChunkStream(Local<Function> callback) : paused(false) {
+		cb.Reset(callback);
+		token.Reset(Nan::New<Object>());
+		Nan::Set(Nan::New(token), 0, Nan::New<External>(this));
+		uv_mutex_init(&lock);
+		uv_cond_init(&resumed);
+		async = new uv_async_t;
+		uv_async_init(uv_default_loop(), async, ChunkStream::onAsync);
+		async->data = this;
+	}
+
+	ChunkStream::~ChunkStream() {
+		if (async)
+			uv_close(reinterpret_cast<uv_handle_t*>(async), ChunkStream::onClose);
+		for (size_t i = 0; i < blocks.size(); ++i)
+			free(blocks[i].first);
+		Nan::Set(Nan::New(token), 0, Nan::Undefined());
+		token.Reset();
+		uv_cond_destroy(&resumed);
+		uv_mutex_destroy(&lock);
+		cb.Reset();
+	}
+
+	void ChunkStream::block(char * data, size_t length) {
+		uv_mutex_lock(&lock);
+		blocks.push_back(std::make_pair(data, length));
+		uv_async_send(async);
+		// Keep at most one block waiting for the v8 thread, and none while paused.
+		while (blocks.size() > (paused ? 0 : 1))
+			uv_cond_wait(&resumed, &lock);
+		uv_mutex_unlock(&lock);
+	}
+
+	void ChunkStream::drain(bool force) {
+		Nan::HandleScope scope;
+		for (;;) {
+			uv_mutex_lock(&lock);
+			if (blocks.empty() || (paused && !force)) {
+				uv_mutex_unlock(&lock);
+				return;
+			}
+			std::pair<char*, size_t> ready = blocks.front();
+			blocks.pop_front();
+			uv_cond_signal(&resumed);
+			uv_mutex_unlock(&lock);
+
+			Local<Object> buffer;
+			if (!Nan::NewBuffer(ready.first, ready.second).ToLocal(&buffer)) {
+				free(ready.first);
+				continue;
+			}
+			if (makeCallback(Nan::New(cb), 0, buffer)->IsFalse()) {
+				uv_mutex_lock(&lock);
+				paused = true;
+				uv_mutex_unlock(&lock);
+			}
+		}
+	}
+
+	void ChunkStream::onAsync(uv_async_t * handle) {
+		static_cast<ChunkStream*>(handle->data)->drain(false);
+	}
+
+	void ChunkStream::close() {
+		drain(true);
+		uv_close(reinterpret_cast<uv_handle_t*>(async), ChunkStream::onClose);
+		async = 0;
+	}
+
+	void ChunkStream::onClose(uv_handle_t * handle) {
+		delete reinterpret_cast<uv_async_t*>(handle);
+	}
+
+	Local<Function> ChunkStream::resumer() {
+		return Nan::GetFunction(Nan::New<FunctionTemplate>(resume, Nan::New(token))).ToLocalChecked();
+	}
+
+	NAN_METHOD(ChunkStream::resume) {
+		Local<Value> v = Nan::Get(Local<Object>::Cast(info.Data()), 0).FromMaybe(Local<Value>(Nan::Undefined()));
+		if (!v->IsExternal())
+			return;
+		ChunkStream * self = static_cast<ChunkStream*>(Local<External>::Cast(v)->Value());
+		uv_mutex_lock(&self->lock);
+		self->paused = false;
+		uv_cond_signal(&self->resumed);
+		uv_mutex_unlock(&self->lock);
+		if (self->async)
+			uv_async_send(self->async);
+	}
+
 }
@@ -1,6 +1,9 @@
 #ifndef picha_writebuffer_h_
 #define picha_writebuffer_h_
 
+#include <deque>
+#include <utility>
+
 #include "picha.h"
 
 namespace picha {
@@ -10,13 +13,32 @@ namespace picha {
 
 	struct WriteBuffer {
 
-		WriteBuffer() : hblock(0), cblock(0), totallen(0), cursor(0) {}
+		// Takes each block, and ownership of its malloc'd data, as soon as it fills, for
+		// writers that never seek back.
+		struct Sink {
+			virtual ~Sink() {}
+			virtual void block(char * data, size_t length) = 0;
+		};
+
+		WriteBuffer() : hblock(0), cblock(0), totallen(0), cursor(0), sink(0) {}
 		~WriteBuffer() { delete hblock; }
 
-		void write(char * data, size_t length);
+		// False if a block can't be allocated.
+		bool write(char * data, size_t length);
 		void seek(size_t o, int whence);
+		// The buffer's data in one malloc'd block, or 0 if that can't be allocated.
 		char * consolidate_();
 
+		// Pass the last, partly filled, block to the sink.
+		void flush_();
+
+		// For writers that fill the buffer in place, like libjpeg's destination manager.
+		// next_ returns the free space at the cursor, appending a block of at least
+		// 'length' bytes if there is none, or 0 if that can't be allocated. advance_ moves
+		// the cursor past the bytes written to it.
+		char * next_(size_t length, size_t & space);
+		void advance_(size_t length);
+
 		//--
 
 		struct WriteBlock {
@@ -32,10 +54,47 @@ namespace picha {
 
 		void seek_(size_t length);
 
+		// Start a new block after the current one, or in its place when a sink has it.
+		bool append_(size_t length);
+
 		WriteBlock * hblock;
 		WriteBlock * cblock;
 		size_t totallen;
 		size_t cursor;
+		Sink * sink;
+	};
+
+	// A sink that passes the blocks of an encode on a libuv thread to a js callback, as
+	// buffers that take over the block data. The encoder waits at a full block while
+	// another is still waiting for the v8 thread. When the callback returns false the
+	// chunks stop, and the encoder waits at its next full block, until the function from
+	// resumer() is called.
+	struct ChunkStream : public WriteBuffer::Sink {
+		ChunkStream(Local<Function> cb);
+		~ChunkStream();
+
+		// Called from the encoding thread.
+		void block(char * data, size_t length);
+
+		// Called on the v8 thread once the encode is done, to pass on the last blocks
+		// whether paused or not.
+		void close();
+
+		// A js function that resumes the chunks, which does nothing once the stream is gone.
+		Local<Function> resumer();
+
+		void drain(bool force);
+		static void onAsync(uv_async_t * handle);
+		static void onClose(uv_handle_t * handle);
+		static NAN_METHOD(resume);
+
+		Nan::Persistent<Function> cb;
+		Nan::Persistent<Object> token;
+		uv_async_t * async;
+		uv_mutex_t lock;
+		uv_cond_t resumed;
+		bool paused;
+		std::deque<std::pair<char*, size_t> > blocks;
 	};
 
 }
@@ -74,6 +74,311 @@ describe('jpeg_codec', function() {
 	testFile("test2g.jpg", 76, 50, 'grey');
 	testFile("test2cmyk.jpg", 76, 50, 'rgb');
 
+	describe("decode to size", function() {
+		var file;
+		it("should load test jpeg", function() {
+			file = fs.readFileSync(path.join(__dirname, "test2g.jpg"));
+		});
+		it("should stat the scaled sizes", function() {
+			var stat = picha.statJpeg(file);
+			assert.equal(stat.scales.length, 8);
+			assert.deepEqual(stat.scales[1], { scale: 0.25, width: 19, height: 13 });
+			assert.deepEqual(stat.scales[7], { scale: 1, width: 76, height: 50 });
+		});
+		it("should decode at the smallest covering scale", function() {
+			var image = picha.decodeJpegSync(file, { maxWidth: 30, maxHeight: 30 });
+			assert.equal(image.width, 38);
+			assert.equal(image.height, 25);
+			image = picha.decodeJpegSync(file, { scale: 0.25 });
+			assert.equal(image.width, 19);
+			assert.equal(image.height, 13);
+		});
+		it("should reject an invalid scale", function() {
+			assert.throws(function() { picha.decodeJpegSync(file, { scale: 0 }); });
+		});
+		it("should decode a region", function() {
+			var full = picha.decodeJpegSync(file);
+			var image = picha.decodeJpegSync(file, { region: { x: 13, y: 7, width: 30, height: 20 } });
+			assert.equal(image.width, 30);
+			assert.equal(image.height, 20);
+			var expected = new picha.Image({ width: 30, height: 20, pixel: full.pixel });
+			full.subView(13, 7, 30, 20).copy(expected);
+			assert(image.avgChannelDiff(expected) < 1);
+			assert.throws(function() { picha.decodeJpegSync(file, { region: { x: 70, y: 0, width: 10, height: 10 } }); });
+		});
+	});
+
+	describe("decode to a pixel format", function() {
+		var file, image;
+		it("should load test jpeg", function() {
+			file = fs.readFileSync(path.join(__dirname, "test2cmyk.jpg"));
+			image = picha.decodeJpegSync(file);
+		});
+		it("should decode rgba", function() {
+			var rgba = picha.decodeJpegSync(file, { pixel: 'rgba' });
+			assert.equal(rgba.pixel, 'rgba');
+			assert(rgba.equalPixels(picha.colorConvertSync(image, { pixel: 'rgba' })));
+		});
+		it("should decode grey", function() {
+			var grey = picha.decodeJpegSync(fs.readFileSync(path.join(__dirname, "test.jpeg")), { pixel: 'grey' });
+			assert.equal(grey.pixel, 'grey');
+			assert.equal(grey.width, 50);
+		});
+	});
+
+	describe("decode and encode speed", function() {
+		var file, image;
+		it("should load test jpeg", function() {
+			file = fs.readFileSync(path.join(__dirname, "test.jpeg"));
+			image = picha.decodeJpegSync(file);
+		});
+		it("should decode closely in draft mode", function() {
+			var draft = picha.decodeJpegSync(file, { speed: 'draft' });
+			assert(draft.avgChannelDiff(image) < 2);
+			assert.throws(function() { picha.decodeJpegSync(file, { speed: 'quick' }); });
+		});
+		it("should encode closely in fast mode", function() {
+			var accurate = picha.decodeJpegSync(picha.encodeJpegSync(image, {}));
+			var fast = picha.decodeJpegSync(picha.encodeJpegSync(image, { speed: 'fast' }));
+			assert(fast.avgChannelDiff(image) < accurate.avgChannelDiff(image) + 0.5);
+		});
+	});
+
+	describe("parallel encode and decode", function() {
+		var image, single, banded;
+		it("should encode in bands", function() {
+			var src = picha.decodeJpegSync(fs.readFileSync(path.join(__dirname, "test.jpeg")));
+			image = picha.resizeSync(src, { width: 400, height: 400 });
+			single = picha.encodeJpegSync(image, { quality: 90 });
+			banded = picha.encodeJpegSync(image, { quality: 90, threads: 4 });
+			assert(picha.decodeJpegSync(banded, { threads: 1 }).equalPixels(picha.decodeJpegSync(single)));
+		});
+		it("should decode in bands", function() {
+			var a = picha.decodeJpegSync(banded, { threads: 1 });
+			assert(picha.decodeJpegSync(banded, { threads: 4 }).equalPixels(a));
+			assert(picha.decodeJpegSync(banded, { threads: 4, scale: 0.5 }).equalPixels(picha.decodeJpegSync(banded, { threads: 1, scale: 0.5 })));
+		});
+	});
+
+	describe("encode modes", function() {
+		var image, plain;
+		it("should report the size", function() {
+			image = picha.decodeJpegSync(fs.readFileSync(path.join(__dirname, "test.jpeg")));
+			var report = {};
+			plain = picha.encodeJpegSync(image, { report: report });
+			assert.equal(report.size, plain.length);
+			assert(report.time >= 0);
+		});
+		it("should encode smaller when optimized", function() {
+			var optimized = picha.encodeJpegSync(image, { optimize: true });
+			assert(optimized.length < plain.length);
+			assert(picha.decodeJpegSync(optimized).equalPixels(picha.decodeJpegSync(plain)));
+			var progressive = picha.encodeJpegSync(image, { progressive: true });
+			assert(picha.decodeJpegSync(progressive).equalPixels(picha.decodeJpegSync(plain)));
+		});
+		it("should encode to a target size", function() {
+			var report = {};
+			var target = Math.floor(plain.length * 0.8);
+			var buf = picha.encodeJpegSync(image, { targetBytes: target, report: report });
+			assert(buf.length <= target);
+			assert(report.quality < 85);
+			assert(buf.equals(picha.encodeJpegSync(image, { quality: report.quality })));
+			assert(picha.encodeJpegSync(image, { quality: report.quality + 1 }).length > target);
+		});
+		it("should encode to a target similarity", function() {
+			var report = {};
+			picha.encodeJpegSync(image, { targetSsim: 0.95, report: report });
+			assert(report.ssim >= 0.95);
+			var lower = {};
+			picha.encodeJpegSync(image, { targetSsim: 0.9, report: lower });
+			assert(lower.quality <= report.quality);
+		});
+		it("should fail a target no quality reaches", function(done) {
+			assert.throws(function() { picha.encodeJpegSync(image, { targetBytes: 100 }); }, /target not reachable/);
+			assert.throws(function() { picha.encodeJpegSync(image, { targetSsim: 0.99999 }); }, /target not reachable/);
+			picha.encodeJpeg(image, { targetBytes: 100 }, function(err, buf) {
+				assert(err && !buf);
+				done();
+			});
+		});
+		it("should encode without chroma subsampling", function() {
+			var full = picha.decodeJpegSync(picha.encodeJpegSync(image, { subsampling: '4:4:4' }));
+			assert(full.avgChannelDiff(image) < picha.decodeJpegSync(plain).avgChannelDiff(image));
+			assert.throws(function() { picha.encodeJpegSync(image, { subsampling: '4:1:1' }); });
+		});
+	});
+
+	describe("lossless transforms", function() {
+		var file, image;
+		it("should load test jpeg", function() {
+			file = fs.readFileSync(path.join(__dirname, "test2g.jpg"));
+			image = picha.decodeJpegSync(file);
+		});
+		it("should rotate", function() {
+			var rotated = picha.decodeJpegSync(picha.transformJpegSync(file, { rotate: 90 }));
+			assert.equal(rotated.width, 48);
+			assert.equal(rotated.height, 76);
+			// The bottom rows are trimmed and the rest turn clockwise.
+			for (var y = 0; y < rotated.height; y += 15) {
+				for (var x = 0; x < rotated.width; x += 15) {
+					var a = rotated.row(y)[x], b = image.row(47 - x)[y];
+					assert(Math.abs(a - b) < 4);
+				}
+			}
+		});
+		it("should crop on the block grid", function(done) {
+			picha.transformJpeg(file, { crop: { x: 20, y: 10, width: 30, height: 20 } }, function(err, buf) {
+				if (err) return done(err);
+				var cropped = picha.decodeJpegSync(buf);
+				var expected = new picha.Image({ width: 34, height: 22, pixel: 'grey' });
+				image.subView(16, 8, 34, 22).copy(expected);
+				assert(cropped.equalPixels(expected));
+				done();
+			});
+		});
+		it("should reject an invalid rotation", function() {
+			assert.throws(function() { picha.transformJpegSync(file, { rotate: 45 }); });
+		});
+	});
+
+	describe("requantize", function() {
+		var file, image;
+		it("should load test jpeg", function() {
+			file = fs.readFileSync(path.join(__dirname, "test.jpeg"));
+			image = picha.decodeJpegSync(file);
+		});
+		it("should lower the quality", function() {
+			var buf = picha.requantizeJpegSync(file, { quality: 70 });
+			assert(buf.length < file.length);
+			var requantized = picha.decodeJpegSync(buf);
+			assert.equal(requantized.width, image.width);
+			assert(requantized.avgChannelDiff(image) < 4);
+		});
+		it("should reject an invalid quality", function() {
+			assert.throws(function() { picha.requantizeJpegSync(file, { quality: 0 }); });
+		});
+	});
+
+	describe("progressive preview", function() {
+		var file, image;
+		it("should encode a progressive jpeg", function() {
+			var src = picha.decodeJpegSync(fs.readFileSync(path.join(__dirname, "test2.jpg")));
+			file = picha.encodeJpegSync(src, { progressive: true });
+			image = picha.decodeJpegSync(file);
+			assert(picha.statJpeg(file).progressive);
+		});
+		it("should decode the first scans", function() {
+			var preview = picha.decodeJpegSync(file, { maxScans: 1 });
+			assert.equal(preview.width, image.width);
+			assert.equal(preview.height, image.height);
+			var diff = preview.avgChannelDiff(image);
+			assert(diff > 0 && diff < 32);
+			assert(picha.decodeJpegSync(file, { maxScans: 3 }).avgChannelDiff(image) < diff);
+		});
+		it("should decode every scan there is", function() {
+			assert.equal(picha.decodeJpegSync(file, { maxScans: 1000 }).avgChannelDiff(image), 0);
+		});
+		it("should reject an invalid maxScans", function() {
+			assert.throws(function() { picha.decodeJpegSync(file, { maxScans: 0 }); });
+		});
+	});
+
+	describe("streaming decode", function() {
+		var file = fs.readFileSync(path.join(__dirname, "test2.jpg"));
+		it("should decode pushed chunks", function(done) {
+			var decoder = picha.createDecoder("image/jpeg", { pixel: "grey" });
+			for (var i = 0; i < file.length; i += 1000)
+				decoder.push(file.slice(i, i + 1000));
+			decoder.end(function(err, image) {
+				if (!err) assert(image.equalPixels(picha.decodeJpegSync(file, { pixel: "grey" })));
+				done(err);
+			});
+		});
+		it("should decode a progressive jpeg a few bytes at a time", function() {
+			var progressive = picha.encodeJpegSync(picha.decodeJpegSync(file), { progressive: true });
+			var decoder = picha.createDecoder("image/jpeg", { maxWidth: 100 });
+			for (var i = 0; i < progressive.length; i += 7)
+				decoder.pushSync(progressive.slice(i, i + 7));
+			assert(decoder.endSync().equalPixels(picha.decodeJpegSync(progressive, { maxWidth: 100 })));
+		});
+		it("should fail a truncated jpeg", function() {
+			var decoder = picha.createDecoder("image/jpeg");
+			decoder.pushSync(file.slice(0, file.length / 2));
+			assert.throws(function() { decoder.endSync(); });
+		});
+	});
+
+	describe("streaming encode", function() {
+		it("should stream the same jpeg in chunks", function(done) {
+			var src = picha.decodeJpegSync(fs.readFileSync(path.join(__dirname, "test.jpeg")));
+			var image = picha.resizeSync(src, { width: 800, height: 800 });
+			var chunks = [];
+			picha.encodeJpegStream(image, { quality: 100 }).on('data', function(chunk) {
+				chunks.push(chunk);
+			}).on('error', done).on('end', function() {
+				assert(chunks.length > 1);
+				assert(Buffer.concat(chunks).equals(picha.encodeJpegSync(image, { quality: 100 })));
+				done();
+			});
+		});
+	});
+
+	describe("embedded thumbnail", function() {
+		// Put a jpeg thumbnail in a little endian EXIF APP1 segment: an empty IFD0 and an
+		// IFD1 with the thumbnail's offset and length.
+		function withThumbnail(file, thumb) {
+			var tiff = Buffer.alloc(44);
+			tiff.write("II", 0);
+			tiff.writeUInt16LE(42, 2);
+			tiff.writeUInt32LE(8, 4);
+			tiff.writeUInt32LE(14, 10);
+			tiff.writeUInt16LE(2, 14);
+			tiff.writeUInt16LE(0x201, 16);
+			tiff.writeUInt16LE(4, 18);
+			tiff.writeUInt32LE(1, 20);
+			tiff.writeUInt32LE(44, 24);
+			tiff.writeUInt16LE(0x202, 28);
+			tiff.writeUInt16LE(4, 30);
+			tiff.writeUInt32LE(1, 32);
+			tiff.writeUInt32LE(thumb.length, 36);
+			var app1 = Buffer.alloc(10);
+			app1.writeUInt16BE(0xFFE1, 0);
+			app1.writeUInt16BE(8 + tiff.length + thumb.length, 2);
+			app1.write("Exif\0\0", 4, "binary");
+			return Buffer.concat([ file.slice(0, 2), app1, tiff, thumb, file.slice(2) ]);
+		}
+
+		var file, image, thumb;
+		it("should load test jpeg", function() {
+			var src = fs.readFileSync(path.join(__dirname, "test2.jpg"));
+			image = picha.decodeJpegSync(src);
+			thumb = picha.resizeSync(image, { width: Math.round(image.width / 4), height: Math.round(image.height / 4) });
+			var thumbfile = picha.encodeJpegSync(thumb, {});
+			thumb = picha.decodeJpegSync(thumbfile);
+			file = withThumbnail(src, thumbfile);
+		});
+		it("should stat the thumbnail", function() {
+			var stat = picha.statJpeg(file);
+			assert.equal(stat.width, image.width);
+			assert.equal(stat.thumbnail.width, thumb.width);
+			assert.equal(stat.thumbnail.height, thumb.height);
+			assert(stat.thumbnail.size > 0);
+			assert.equal(picha.statJpeg(fs.readFileSync(path.join(__dirname, "test2.jpg"))).thumbnail, undefined);
+		});
+		it("should decode the thumbnail when it is large enough", function() {
+			var small = picha.decodeJpegSync(file, { preferEmbeddedThumbnail: thumb.width });
+			assert.equal(small.width, thumb.width);
+			assert.equal(small.avgChannelDiff(thumb), 0);
+			var full = picha.decodeJpegSync(file, { preferEmbeddedThumbnail: thumb.width + 1 });
+			assert.equal(full.width, image.width);
+		});
+		it("should not decode a letterboxed thumbnail", function() {
+			var boxed = picha.resizeSync(image, { width: thumb.width, height: thumb.width });
+			var other = withThumbnail(fs.readFileSync(path.join(__dirname, "test2.jpg")), picha.encodeJpegSync(boxed, {}));
+			assert.equal(picha.decodeJpegSync(other, { preferEmbeddedThumbnail: 1 }).width, image.width);
+		});
+	});
+
 	describe("encodes images with alpha", function() {
 		var img;
 		it("should load test.png", function() {
@@ -40,6 +40,13 @@ describe('png_codec', function() {
 		it("should be the same sync or async", function() {
 			assert(syncImage.equalPixels(asyncImage));
 		});
+		it("should skip checks of a trusted png", function() {
+			var blob = Buffer.from(picha.encodePngSync(syncImage));
+			assert(picha.decodePngSync(blob, { trusted: true }).equalPixels(syncImage));
+			blob[blob.length - 16] ^= 1;
+			assert.throws(function() { picha.decodePngSync(blob); });
+			picha.decodePngSync(blob, { trusted: true });
+		});
 	});
 	describe("encode", function() {
 		it("should async encode", function(done) {
@@ -55,6 +62,75 @@ describe('png_codec', function() {
 			assert(picha.Image.bufferCompare(asyncPng, syncPng) === 0);
 		});
 	});
+	describe("encode options", function() {
+		it("should round trip each speed", function() {
+			var sizes = [ "fastest", "fast", "default", "smallest" ].map(function(speed) {
+				var blob = picha.encodePngSync(syncImage, { speed: speed });
+				assert(picha.decodePngSync(blob).equalPixels(syncImage));
+				return blob.length;
+			});
+			assert(sizes[3] < sizes[0]);
+		});
+		it("should round trip zlib and filter settings", function() {
+			var blob = picha.encodePngSync(syncImage, { compressionLevel: 2, strategy: "huffman", filters: [ "sub", "paeth" ], windowBits: 10, memLevel: 4 });
+			assert(picha.decodePngSync(blob).equalPixels(syncImage));
+		});
+		it("should encode in parallel bands", function() {
+			var large = picha.resizeSync(syncImage, { width: 600, height: 600 });
+			var blob = picha.encodePngSync(large, { threads: 3 });
+			assert(picha.decodePngSync(blob).equalPixels(large));
+			assert(picha.Image.bufferCompare(blob, picha.encodePngSync(large, { threads: 2 })) === 0);
+		});
+		it("should keep the smallest optimize trial", function() {
+			var report = {};
+			var blob = picha.encodePngSync(syncImage, { optimize: 2, report: report });
+			assert(picha.decodePngSync(blob).equalPixels(syncImage));
+			assert(blob.length <= picha.encodePngSync(syncImage).length);
+			assert.equal(report.size, blob.length);
+			var again = picha.encodePngSync(syncImage, { filters: report.filters, strategy: report.strategy, compressionLevel: report.compressionLevel, memLevel: report.memLevel });
+			assert.equal(again.length, blob.length);
+		});
+		it("should brute force row filters", function() {
+			var blob = picha.encodePngSync(syncImage, { filters: "brute" });
+			assert(picha.decodePngSync(blob).equalPixels(syncImage));
+		});
+		it("should reject invalid options", function() {
+			assert.throws(function() { picha.encodePngSync(syncImage, { speed: "slow" }); });
+			assert.throws(function() { picha.encodePngSync(syncImage, { compressionLevel: 10 }); });
+			assert.throws(function() { picha.encodePngSync(syncImage, { filters: [ "sub", "diagonal" ] }); });
+			assert.throws(function() { picha.encodePngSync(syncImage, { optimize: 4 }); });
+		});
+	});
+	describe("palette", function() {
+		it("should quantize to a palette", function() {
+			var report = {};
+			var blob = picha.encodePngSync(syncImage, { palette: 16, report: report });
+			var image = picha.decodePngSync(blob);
+			assert.equal(image.pixel, "rgba");
+			assert(image.avgChannelDiff(syncImage) < 8);
+			assert(blob.length < syncPng.length);
+			assert.equal(report.colors, 16);
+			assert.equal(report.exact, false);
+		});
+		it("should dither", function() {
+			var image = picha.decodePngSync(picha.encodePngSync(syncImage, { palette: 16, dither: true }));
+			assert(image.avgChannelDiff(syncImage) < 8);
+		});
+		it("should keep few enough colours exactly", function() {
+			var few = picha.decodePngSync(picha.encodePngSync(syncImage, { palette: 12 }));
+			[ 1, 3 ].forEach(function(threads) {
+				var report = {};
+				var image = picha.decodePngSync(picha.encodePngSync(few, { palette: 256, threads: threads, report: report }));
+				assert(image.equalPixels(few));
+				assert.equal(report.colors, 12);
+				assert.equal(report.exact, true);
+			});
+		});
+		it("should reject a 16 bit image", function() {
+			var deep = picha.colorConvertSync(syncImage, { pixel: "r16g16b16a16" });
+			assert.throws(function() { picha.encodePngSync(deep, { palette: 256 }); });
+		});
+	});
 	describe("round trip", function() {
 		it("async match original", function(done) {
 			picha.decodePng(asyncPng, function(err, image) {
@@ -67,6 +143,67 @@ describe('png_codec', function() {
 			assert(image.equalPixels(syncImage));
 		});
 	});
+	describe("streaming decode", function() {
+		var file = fs.readFileSync(path.join(__dirname, "test.png"));
+		it("should decode pushed chunks", function(done) {
+			var decoder = picha.createDecoder("image/png");
+			for (var i = 0; i < file.length; i += 1000)
+				decoder.push(file.slice(i, i + 1000));
+			decoder.end(function(err, image) {
+				if (!err) assert(image.equalPixels(syncImage));
+				done(err);
+			});
+		});
+		it("should decode sync", function() {
+			var decoder = picha.createDecoder("image/png");
+			assert.equal(decoder.stat(), undefined);
+			decoder.pushSync(file.slice(0, 0));
+			for (var i = 0; i < file.length; i += 100)
+				decoder.pushSync(file.slice(i, i + 100));
+			assert.equal(decoder.stat().rows, syncImage.height);
+			assert(decoder.endSync().equalPixels(syncImage));
+		});
+		it("should fail a truncated png", function(done) {
+			var decoder = picha.createDecoder("image/png");
+			decoder.push(file.slice(0, file.length / 2));
+			decoder.end(function(err, image) {
+				assert(err);
+				done();
+			});
+		});
+	});
+	describe("streaming encode", function() {
+		it("should stream the same png in chunks", function(done) {
+			var opt = { compressionLevel: 0, threads: 3 };
+			var image = picha.resizeSync(syncImage, { width: 400, height: 400 });
+			var chunks = [];
+			picha.encodePngStream(image, opt).on('data', function(chunk) {
+				chunks.push(chunk);
+			}).on('error', done).on('end', function() {
+				assert(chunks.length > 1);
+				assert(Buffer.concat(chunks).equals(picha.encodePngSync(image, opt)));
+				done();
+			});
+		});
+		it("should hold the encoder back for a slow reader", function(done) {
+			var opt = { compressionLevel: 0 };
+			var image = picha.resizeSync(syncImage, { width: 600, height: 600 });
+			var stream = picha.encodePngStream(image, opt);
+			var chunks = [], most = 0, ended = false;
+			stream.on('error', done).on('end', function() {
+				ended = true;
+				assert(most <= 64 * 1024);
+				assert(Buffer.concat(chunks).equals(picha.encodePngSync(image, opt)));
+				done();
+			});
+			(function pull() {
+				most = Math.max(most, stream.readableLength);
+				var chunk = stream.read();
+				if (chunk) chunks.push(chunk);
+				if (!ended) setTimeout(pull, 2);
+			})();
+		});
+	});
 	describe("deep pixels", function() {
 		it("stat 16 bit image", function(done) {
 			fs.readFile(path.join(__dirname, "test16.png"), function(err, buf) {
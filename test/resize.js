@@ -29,4 +29,79 @@ describe('resize', function() {
 		assert(syncSmall.avgChannelDiff(smallImage) < 2);
 		assert(syncSmall.equalPixels(asyncSmall));
 	});
+	it("should match the serial resize when banded", function() {
+		var large = { width: 400, height: 300 };
+		var serial = picha.resizeSync(image, { width: large.width, height: large.height, threads: 1 });
+		var banded = picha.resizeSync(image, { width: large.width, height: large.height, threads: 4 });
+		assert(banded.equalPixels(serial));
+	});
+	it("should reject an invalid thread count", function() {
+		assert.throws(function() { picha.resizeSync(image, { width: 32, height: 24, threads: 0 }); });
+	});
+	it("should resize closely with fast precision", function() {
+		var accurate = picha.resizeSync(image, { width: 400, height: 300 });
+		var fast = picha.resizeSync(image, { width: 400, height: 300, precision: 'fast' });
+		assert(fast.avgChannelDiff(accurate) < 0.5);
+		assert.throws(function() { picha.resizeSync(image, { width: 32, height: 24, precision: 'sloppy' }); });
+	});
+	it("should keep every fast sample within one of accurate", function() {
+		// Hard edges, where lanczos overshoots and clamps.
+		var checks = new picha.Image({ width: 101, height: 77, pixel: 'rgb' });
+		for (var y = 0; y < checks.height; ++y) {
+			for (var x = 0; x < checks.width * 3; ++x)
+				checks.data[y * checks.stride + x] = ((x / 3 >> 2) + (y >> 3) + x % 3) % 2 ? 255 : 0;
+		}
+		[image, checks].forEach(function(src) {
+			['cubic', 'lanczos', 'mitchel', 'triangle'].forEach(function(filter) {
+				[[37, 29], [230, 170]].forEach(function(size) {
+					var opt = { width: size[0], height: size[1], filter: filter };
+					var accurate = picha.resizeSync(src, opt);
+					opt.precision = 'fast';
+					var fast = picha.resizeSync(src, opt);
+					for (var y = 0; y < fast.height; ++y) {
+						var a = accurate.row(y), f = fast.row(y);
+						for (var i = 0; i < fast.width * fast.pixelSize(); ++i)
+							assert(Math.abs(f[i] - a[i]) <= 1, filter + " " + size);
+					}
+				});
+			});
+		});
+	});
+	it("should copy a dimension that keeps its size", function() {
+		var same = picha.resizeSync(image, { width: image.width, height: image.height });
+		assert(same.equalPixels(image));
+		var rows = picha.resizeSync(image, { width: image.width, height: 24 });
+		var columns = picha.resizeSync(rows, { width: 32, height: 24 });
+		assert(columns.avgChannelDiff(smallImage) < 2);
+	});
+	it("should resize closely with box reduction", function() {
+		var large = picha.resizeSync(image, { width: 760, height: 500 });
+		var filtered = picha.resizeSync(large, { width: 32, height: 24 });
+		var reduced = picha.resizeSync(large, { width: 32, height: 24, reduce: true });
+		assert(reduced.avgChannelDiff(filtered) < 1);
+	});
+	it("should not shift a ramp with box reduction", function() {
+		var ramp = new picha.Image({ width: 4000, height: 1, pixel: 'r16' });
+		for (var x = 0; x < ramp.width; ++x)
+			ramp.data.writeUInt16LE(x * 16, x * 2);
+		[40, 333, 999].forEach(function(width) {
+			var opt = { width: width, height: 1, filter: 'triangle' };
+			var filtered = picha.resizeSync(ramp, opt);
+			opt.reduce = true;
+			var reduced = picha.resizeSync(ramp, opt);
+			var bias = 0;
+			for (var x = 2; x < width - 2; ++x)
+				bias += reduced.data.readUInt16LE(x * 2) - filtered.data.readUInt16LE(x * 2);
+			assert(Math.abs(bias / (width - 4) / 16) < 0.01, width);
+		});
+	});
+	it("should reuse cached filter weights", function() {
+		var before = picha.resizeCacheStats();
+		picha.resizeSync(image, { width: 33, height: 25, filter: 'lanczos' });
+		picha.resizeSync(image, { width: 33, height: 25, filter: 'lanczos' });
+		var after = picha.resizeCacheStats();
+		assert.equal(after.misses, before.misses + 1);
+		assert.equal(after.hits, before.hits + 1);
+		assert(after.entries <= after.capacity);
+	});
 });
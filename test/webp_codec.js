@@ -41,6 +41,26 @@ describe('webp_codec', function() {
 			assert(syncImage.equalPixels(asyncImage));
 		});
 	});
+	describe("streaming decode", function() {
+		var file = fs.readFileSync(path.join(__dirname, "test.webp"));
+		it("should decode pushed chunks", function(done) {
+			var decoder = picha.createDecoder("image/webp");
+			for (var i = 0; i < file.length; i += 100)
+				decoder.push(file.slice(i, i + 100));
+			decoder.end(function(err, image) {
+				if (!err) assert(image.equalPixels(syncImage));
+				done(err);
+			});
+		});
+		it("should decode sync, skipping empty chunks", function() {
+			var decoder = picha.createDecoder("image/webp");
+			decoder.pushSync(file.slice(0, 0));
+			for (var i = 0; i < file.length; i += 10)
+				decoder.pushSync(file.slice(i, i + 10));
+			assert.equal(decoder.stat().rows, syncImage.height);
+			assert(decoder.endSync().equalPixels(syncImage));
+		});
+	});
 	describe("lossless encode", function() {
 		it("should async encode", function(done) {
 			picha.encodeWebP(asyncImage, { preset: 'lossless' }, function(err, blob) {